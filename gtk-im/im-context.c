@@ -18,6 +18,7 @@
  */
 
 #include <gtk/gtkimcontextsimple.h>
+#include <gdk/gdkx.h>
 
 #include "im-context.h"
 #include "im-protocol.h"
@@ -25,10 +26,69 @@
 static GtkIMContextClass *parent_class;
 static GType im_context_type = 0;
 
+static GdkFilterReturn
+mb_im_context_commit_filter (GdkXEvent *gdk_xevent, 
+			     GdkEvent  *event, 
+			     gpointer   data)
+{
+  MbIMContext *self = data;
+  XEvent      *xev  = gdk_xevent;
+  int          len;
+
+  if (xev->type != ClientMessage
+      || xev->xclient.message_type 
+          != gdk_x11_get_xatom_by_name (MB_KBD_REMOTE_COMMIT_ATOM))
+    return GDK_FILTER_CONTINUE;
+
+  len = (unsigned char)xev->xclient.data.b[0] & ~MB_KBD_REMOTE_COMMIT_MORE;
+
+  if (len > MB_KBD_REMOTE_COMMIT_MAX)
+    len = MB_KBD_REMOTE_COMMIT_MAX;
+
+  g_string_append_len (self->commit_text, &xev->xclient.data.b[1], len);
+
+  if (!(xev->xclient.data.b[0] & MB_KBD_REMOTE_COMMIT_MORE))
+    {
+      g_signal_emit_by_name (self, "commit", self->commit_text->str);
+      g_string_truncate (self->commit_text, 0);
+    }
+
+  return GDK_FILTER_REMOVE;
+}
+
+static Window
+mb_im_context_commit_xwin (MbIMContext *self)
+{
+  if (self->commit_window == NULL)
+    {
+      GdkWindowAttr attr;
+
+      /* Never shown, just somewhere for the keyboard to send text */
+      attr.wclass            = GDK_INPUT_ONLY;
+      attr.window_type       = GDK_WINDOW_TEMP;
+      attr.x                 = -1;
+      attr.y                 = -1;
+      attr.width             = 1;
+      attr.height            = 1;
+      attr.event_mask        = 0;
+      attr.override_redirect = TRUE;
+
+      self->commit_window = gdk_window_new (NULL, &attr, 
+					    GDK_WA_X | GDK_WA_Y 
+					    | GDK_WA_NOREDIR);
+
+      gdk_window_add_filter (self->commit_window, 
+			     mb_im_context_commit_filter, self);
+    }
+
+  return GDK_WINDOW_XID (self->commit_window);
+}
+
 static void
 mb_im_context_focus_in (GtkIMContext *context)
 {
-  protocol_send_event (MBKeyboardRemoteShow);
+  protocol_send_event_full (MBKeyboardRemoteShow, 
+			    mb_im_context_commit_xwin ((MbIMContext *)context));
 
   if (GTK_IM_CONTEXT_CLASS (parent_class)->focus_in)
     GTK_IM_CONTEXT_CLASS (parent_class)->focus_in (context);
@@ -43,13 +103,33 @@ mb_im_context_focus_out (GtkIMContext *context)
     GTK_IM_CONTEXT_CLASS (parent_class)->focus_out (context);
 }
 
+static void
+mb_im_context_finalize (GObject *object)
+{
+  MbIMContext *self = (MbIMContext *)object;
+
+  if (self->commit_window)
+    {
+      gdk_window_remove_filter (self->commit_window, 
+				mb_im_context_commit_filter, self);
+      gdk_window_destroy (self->commit_window);
+    }
+
+  g_string_free (self->commit_text, TRUE);
+
+  G_OBJECT_CLASS (parent_class)->finalize (object);
+}
+
 static void
 mb_im_context_class_init (MbIMContextClass *klass)
 {
+  GObjectClass      *object_class = G_OBJECT_CLASS (klass);
   GtkIMContextClass *context_class = GTK_IM_CONTEXT_CLASS (klass);
 
   parent_class = g_type_class_peek_parent (klass);
 
+  object_class->finalize = mb_im_context_finalize;
+
   context_class->focus_in = mb_im_context_focus_in;
   context_class->focus_out = mb_im_context_focus_out;
 }
@@ -57,6 +137,7 @@ mb_im_context_class_init (MbIMContextClass *klass)
 static void
 mb_im_context_init (MbIMContext *self)
 {
+  self->commit_text = g_string_new (NULL);
 }
 
 void
@@ -25,6 +25,9 @@ typedef struct _MbIMContextClass MbIMContextClass;
 struct _MbIMContext
 {
   GtkIMContextSimple context;
+
+  GdkWindow *commit_window; /* the keyboard sends us text here */
+  GString   *commit_text;   /* partial text, till the last chunk */
 };
 
 struct _MbIMContextClass
@@ -27,6 +27,12 @@
 
 void
 protocol_send_event (MBKeyboardRemoteOperation op)
+{
+  protocol_send_event_full (op, None);
+}
+
+void
+protocol_send_event_full (MBKeyboardRemoteOperation op, Window commit_xwin)
 {
   XEvent event;
   int xerror;
@@ -38,6 +44,7 @@ protocol_send_event (MBKeyboardRemoteOperation op)
   event.xclient.message_type = gdk_x11_get_xatom_by_name ("_MB_IM_INVOKER_COMMAND");
   event.xclient.format = 32;
   event.xclient.data.l[0] = op;
+  event.xclient.data.l[1] = commit_xwin;
 
   gdk_error_trap_push ();
 
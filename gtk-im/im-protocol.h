@@ -17,6 +17,9 @@
  *
  */
 
+#include <X11/Xlib.h>
 #include "matchbox-keyboard-remote.h"
 
 void protocol_send_event (MBKeyboardRemoteOperation op);
+
+void protocol_send_event_full (MBKeyboardRemoteOperation op, Window commit_xwin);
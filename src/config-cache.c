@@ -0,0 +1,408 @@
+/*
+ *  Matchbox Keyboard - A lightweight software keyboard.
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2, or (at your option)
+ *  any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ */
+
+/*
+ * Compiled layout cache.
+ *
+ * The XML parses to everything it results in ( layouts, rows, keys and
+ * their faces and actions, with keysyms and modifiers already looked up )
+ * as a flat array of MBKeyboardConfigOp plus a table of interned strings,
+ * see config-loader.c for how that gets built. It is written to
+ *
+ *   $XDG_CACHE_HOME/matchbox-keyboard/<hash of config path>.layout
+ *
+ * ( ~/.cache if XDG_CACHE_HOME is unset ) along with the config file's
+ * path, mtime and size and our version. Next start, if all of those
+ * still match, the file is mmap'd and the ops replayed straight into
+ * the keyboard, strings being just offsets into the mapping. No read,
+ * no Expat, no tag or keysym lookups.
+ *
+ * Nothing here knows about the keyboard itself so the build time layout
+ * compiler can use it too.
+ */
+
+#include "matchbox-keyboard.h"
+#include <stdint.h>
+#include <errno.h>
+#include <sys/mman.h>
+
+#define CONFIG_CACHE_MAGIC   "MBKBDLC"
+#define CONFIG_CACHE_FORMAT  3
+
+typedef struct MBKeyboardConfigCacheHeader
+{
+  char      magic[8];
+  uint32_t  format;
+  char      version[16];  /* VERSION, as the ops follow our enums */
+  int64_t   mtime, mtime_nsec;
+  int64_t   size;
+  uint32_t  path;         /* string offset, to catch hash collisions */
+  uint32_t  search;       /* string offset, what image paths resolved in */
+  uint32_t  n_ops;
+  uint32_t  strings_size;
+}
+MBKeyboardConfigCacheHeader;
+
+struct MBKeyboardConfigCache
+{
+  MBKeyboardConfigOp *ops;
+  int                 n_ops, ops_size;
+
+  char               *strings;
+  unsigned int        strings_len, strings_size;
+
+  /* open addressed, string offset + 1 so 0 is empty */
+  unsigned int       *interned;
+  unsigned int        interned_size, n_interned;
+};
+
+static void
+config_cache_rehash (MBKeyboardConfigCache *cache)
+{
+  unsigned int *old = cache->interned, old_size = cache->interned_size;
+  unsigned int  i, j;
+
+  cache->interned_size = old_size ? old_size * 2 : 256;
+  cache->interned = util_malloc0(sizeof(unsigned int) * cache->interned_size);
+
+  for (i = 0; i < old_size; i++)
+    if (old[i])
+      {
+	j = util_hash_str(cache->strings + old[i] - 1);
+
+	while (cache->interned[j & (cache->interned_size - 1)])
+	  j++;
+
+	cache->interned[j & (cache->interned_size - 1)] = old[i];
+      }
+
+  free(old);
+}
+
+static unsigned int
+config_cache_intern (MBKeyboardConfigCache *cache, const char *str)
+{
+  unsigned int i, len;
+
+  if (cache->n_interned * 2 >= cache->interned_size)
+    config_cache_rehash (cache);
+
+  for (i = util_hash_str(str);
+       cache->interned[i & (cache->interned_size - 1)];
+       i++)
+    {
+      unsigned int offset = cache->interned[i & (cache->interned_size - 1)] - 1;
+
+      if (streq(cache->strings + offset, str))
+	return offset;
+    }
+
+  len = strlen(str) + 1;
+
+  while (cache->strings_len + len > cache->strings_size)
+    {
+      cache->strings_size = cache->strings_size ? cache->strings_size * 2 : 1024;
+      cache->strings = realloc(cache->strings, cache->strings_size);
+    }
+
+  memcpy(cache->strings + cache->strings_len, str, len);
+
+  cache->interned[i & (cache->interned_size - 1)] = cache->strings_len + 1;
+  cache->n_interned++;
+
+  cache->strings_len += len;
+
+  return cache->strings_len - len;
+}
+
+MBKeyboardConfigCache*
+mb_kbd_config_cache_new (void)
+{
+  MBKeyboardConfigCache *cache;
+
+  cache = util_malloc0(sizeof(MBKeyboardConfigCache));
+
+  /* Offset 0 is the empty string, for ops with none */
+  config_cache_intern (cache, "");
+
+  return cache;
+}
+
+void
+mb_kbd_config_cache_append (MBKeyboardConfigCache  *cache,
+			    MBKeyboardConfigOpType  type,
+			    MBKeyboardKeyStateType  state,
+			    int                     flags,
+			    unsigned int            value,
+			    const char             *str)
+{
+  MBKeyboardConfigOp *op;
+
+  if (cache->n_ops == cache->ops_size)
+    {
+      cache->ops_size = cache->ops_size ? cache->ops_size * 2 : 256;
+      cache->ops = realloc(cache->ops,
+			   sizeof(MBKeyboardConfigOp) * cache->ops_size);
+    }
+
+  op = &cache->ops[cache->n_ops++];
+
+  op->type  = type;
+  op->state = state;
+  op->flags = flags;
+  op->value = value;
+  op->str   = str ? config_cache_intern (cache, str) : 0;
+}
+
+/* Sets ops[i].value to str, interned, eg the path an image resolved to */
+void
+mb_kbd_config_cache_set_value_str (MBKeyboardConfigCache *cache,
+				   int                    i,
+				   const char            *str)
+{
+  cache->ops[i].value = config_cache_intern (cache, str);
+}
+
+void
+mb_kbd_config_cache_free (MBKeyboardConfigCache *cache)
+{
+  free(cache->ops);
+  free(cache->strings);
+  free(cache->interned);
+  free(cache);
+}
+
+/* Where the cache for config_path lives, dir is created if make_dir */
+static boolean
+config_cache_path (const char *config_path,
+		   char       *path,
+		   int         len,
+		   boolean     make_dir)
+{
+  char dir[1024];
+
+  if (getenv("XDG_CACHE_HOME") && *getenv("XDG_CACHE_HOME"))
+    snprintf(dir, sizeof(dir), "%s/matchbox-keyboard",
+	     getenv("XDG_CACHE_HOME"));
+  else if (getenv("HOME"))
+    {
+      if (make_dir)
+	{
+	  snprintf(dir, sizeof(dir), "%s/.cache", getenv("HOME"));
+	  mkdir(dir, 0700);
+	}
+
+      snprintf(dir, sizeof(dir), "%s/.cache/matchbox-keyboard",
+	       getenv("HOME"));
+    }
+  else
+    return False;
+
+  if (make_dir && mkdir(dir, 0700) && errno != EEXIST)
+    return False;
+
+  snprintf(path, len, "%s/%08x.layout", dir, util_hash_str(config_path));
+
+  return True;
+}
+
+/* search being what any image paths in the ops were resolved against */
+void
+mb_kbd_config_cache_save (MBKeyboardConfigCache *cache,
+			  const char            *config_path,
+			  struct stat           *config_stat,
+			  const char            *search)
+{
+  MBKeyboardConfigCacheHeader header;
+  char                        path[1024], tmp_path[1100];
+  FILE                       *fp;
+  boolean                     ok;
+
+  if (!config_cache_path (config_path, path, sizeof(path), True))
+    return;
+
+  memset(&header, 0, sizeof(header));
+
+  memcpy(header.magic, CONFIG_CACHE_MAGIC, sizeof(header.magic));
+  header.format     = CONFIG_CACHE_FORMAT;
+  strncpy(header.version, VERSION, sizeof(header.version) - 1);
+  header.mtime      = config_stat->st_mtime;
+  header.mtime_nsec = config_stat->st_mtim.tv_nsec;
+  header.size       = config_stat->st_size;
+  header.path       = config_cache_intern (cache, config_path);
+  header.search     = config_cache_intern (cache, search);
+  header.n_ops      = cache->n_ops;
+  header.strings_size = cache->strings_len;
+
+  /* Written aside and renamed into place so a reader never sees half */
+  snprintf(tmp_path, sizeof(tmp_path), "%s.%i", path, getpid());
+
+  if ((fp = fopen(tmp_path, "wb")) == NULL)
+    return;
+
+  ok = (fwrite(&header, sizeof(header), 1, fp) == 1
+	&& fwrite(cache->ops, sizeof(MBKeyboardConfigOp), cache->n_ops, fp)
+	     == cache->n_ops
+	&& fwrite(cache->strings, 1, cache->strings_len, fp)
+	     == cache->strings_len);
+
+  if (fclose(fp) != 0)
+    ok = False;
+
+  if (!ok || rename(tmp_path, path) != 0)
+    {
+      DBG("failed writing %s: %s", path, strerror(errno));
+      unlink(tmp_path);
+      return;
+    }
+
+  DBG("wrote %s, %i ops", path, cache->n_ops);
+}
+
+/* Checked up front so a damaged file falls back to the XML */
+static boolean
+config_cache_ops_valid (const MBKeyboardConfigOp *ops,
+		  int                       n_ops,
+		  unsigned int              strings_size)
+{
+  boolean have_layout = False, have_row = False, have_key = False;
+  int     i;
+
+  for (i = 0; i < n_ops; i++)
+    {
+      if (ops[i].type >= N_MBKeyboardConfigOps
+	  || ops[i].state >= N_MBKeyboardKeyStateTypes
+	  || ops[i].str >= strings_size
+	  || (ops[i].type == MBKeyboardConfigOpImageFace
+	      && ops[i].value >= strings_size))
+	return False;
+
+      switch (ops[i].type)
+	{
+	case MBKeyboardConfigOpLayout:
+	  have_layout = True; have_row = False; have_key = False;
+	  break;
+	case MBKeyboardConfigOpRow:
+	  have_row = have_layout; have_key = False;
+	  if (!have_row) return False;
+	  break;
+	case MBKeyboardConfigOpKey:
+	  have_key = have_row;
+	  if (!have_key) return False;
+	  break;
+	default:
+	  if (!have_key) return False;
+	  break;
+	}
+    }
+
+  return True;
+}
+
+/*
+ * Maps the cache for config_path if there is one matching config_stat
+ * and search ( see mb_kbd_config_cache_save() ), returning the mapping
+ * ( for mb_kbd_config_cache_unmap() ) with ops pointing into it.
+*/
+void*
+mb_kbd_config_cache_map (const char          *config_path,
+			 struct stat         *config_stat,
+			 const char          *search,
+			 MBKeyboardConfigOps *ops)
+{
+  MBKeyboardConfigCacheHeader *header;
+  struct stat                  st;
+  char                         path[1024];
+  void                        *map;
+  int                          fd;
+
+  if (!config_cache_path (config_path, path, sizeof(path), False))
+    return NULL;
+
+  if ((fd = open(path, O_RDONLY)) < 0)
+    return NULL;
+
+  if (fstat(fd, &st) || st.st_size < sizeof(MBKeyboardConfigCacheHeader))
+    {
+      close(fd);
+      return NULL;
+    }
+
+  map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+  close(fd);
+
+  if (map == MAP_FAILED)
+    return NULL;
+
+  header = map;
+
+  ops->ops          = (const MBKeyboardConfigOp *)(header + 1);
+  ops->n_ops        = header->n_ops;
+  ops->strings      = (const char *)(ops->ops + header->n_ops);
+  ops->strings_size = header->strings_size;
+
+  if (memcmp(header->magic, CONFIG_CACHE_MAGIC, sizeof(header->magic))
+      || header->format != CONFIG_CACHE_FORMAT
+      || strncmp(header->version, VERSION, sizeof(header->version) - 1)
+      || header->mtime != config_stat->st_mtime
+      || header->mtime_nsec != config_stat->st_mtim.tv_nsec
+      || header->size != config_stat->st_size
+      || header->n_ops > st.st_size / sizeof(MBKeyboardConfigOp)
+      || sizeof(MBKeyboardConfigCacheHeader)
+           + header->n_ops * sizeof(MBKeyboardConfigOp)
+           + header->strings_size != st.st_size
+      || header->strings_size == 0
+      || ops->strings[header->strings_size - 1] != '\0'
+      || header->path >= header->strings_size
+      || !streq(ops->strings + header->path, config_path)
+      || header->search >= header->strings_size
+      || !streq(ops->strings + header->search, search))
+    {
+      DBG("%s is stale", path);
+      munmap(map, st.st_size);
+      return NULL;
+    }
+
+  if (!config_cache_ops_valid (ops->ops, ops->n_ops, ops->strings_size))
+    {
+      DBG("%s is corrupt", path);
+      munmap(map, st.st_size);
+      return NULL;
+    }
+
+  DBG("mapped %s, %i ops", path, ops->n_ops);
+
+  return map;
+}
+
+void
+mb_kbd_config_cache_unmap (void *map)
+{
+  MBKeyboardConfigCacheHeader *header = map;
+
+  munmap(map, sizeof(MBKeyboardConfigCacheHeader)
+	      + header->n_ops * sizeof(MBKeyboardConfigOp)
+	      + header->strings_size);
+}
+
+void
+mb_kbd_config_cache_get_ops (MBKeyboardConfigCache *cache,
+			     MBKeyboardConfigOps   *ops)
+{
+  ops->ops          = cache->ops;
+  ops->n_ops        = cache->n_ops;
+  ops->strings      = cache->strings;
+  ops->strings_size = cache->strings_len;
+}
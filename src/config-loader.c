@@ -0,0 +1,1103 @@
+/*
+ *  Matchbox Keyboard - A lightweight software keyboard.
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2, or (at your option)
+ *  any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ */
+
+/*
+ * Finding and loading the layout. Whichever way it comes, the keyboard
+ * is built from a flat list of ops ( see MBKeyboardConfigOp ). In order
+ * of preference those are
+ *
+ *  - compiled in, for the shipped layouts ( --enable-builtin-layouts )
+ *    so the default keyboard starts without touching a config file.
+ *  - mmap'd from the layout cache if the file is unchanged, see
+ *    config-cache.c
+ *  - parsed from the XML, see config-parser.c, and then cached.
+ *
+ * Layouts just get their id and the range of ops for their rows, built
+ * by mb_kbd_config_realize_layout() the first time they're selected.
+ * The ops are kept for as long as the layouts are, for that and so a
+ * reload ( see config-watch.c ) can tell what has changed.
+ */
+
+#include "matchbox-keyboard.h"
+#include <dirent.h>
+#include <errno.h>
+
+static char*
+get_assets_dir() {
+  char* assets_dir = getenv("MB_KBD_ASSETS_DIR");
+  return assets_dir ? assets_dir : PKGDATADIR;
+}
+
+/*
+ * Directory listings, each read once, so looking through the candidate
+ * config files and image locations is a lookup per candidate rather
+ * than a stat() ( a round trip apiece with an NFS home ). Forgotten on
+ * reload, as files may have come or gone.
+*/
+typedef struct ConfigDir
+{
+  char     *path;
+  char    **names;		/* sorted */
+  int       n_names;
+  boolean   listed;		/* else unreadable, stat() instead */
+}
+ConfigDir;
+
+static List *ConfigDirs = NULL;
+
+/* A config reload held back by an image, see mb_kbd_config_reload() */
+static boolean ConfigReloadPending = False;
+
+static int
+config_dir_name_cmp (const void *a, const void *b)
+{
+  return strcmp(*(char * const *)a, *(char * const *)b);
+}
+
+static ConfigDir*
+config_dir_get (const char *path)
+{
+  ConfigDir     *dir;
+  DIR           *dp;
+  struct dirent *ent;
+  List          *item;
+  int            size = 0;
+
+  for (item = util_list_get_first(ConfigDirs); item; item = item->next)
+    if (streq(((ConfigDir *)item->data)->path, path))
+      return item->data;
+
+  dir = util_malloc0(sizeof(ConfigDir));
+  dir->path = strdup(path);
+
+  if ((dp = opendir(path)) != NULL)
+    {
+      while ((ent = readdir(dp)) != NULL)
+	{
+	  if (dir->n_names == size)
+	    {
+	      size = size ? size * 2 : 32;
+	      dir->names = realloc(dir->names, sizeof(char *) * size);
+	    }
+
+	  dir->names[dir->n_names++] = strdup(ent->d_name);
+	}
+
+      closedir(dp);
+
+      qsort(dir->names, dir->n_names, sizeof(char *), config_dir_name_cmp);
+      dir->listed = True;
+    }
+  else if (errno == ENOENT || errno == ENOTDIR)
+    dir->listed = True;		/* so nothing in it either */
+
+  DBG("listed %s, %i entries", path, dir->n_names);
+
+  ConfigDirs = util_list_append(ConfigDirs, dir);
+
+  return dir;
+}
+
+static void
+config_dirs_forget (void)
+{
+  List *item;
+  int   i;
+
+  for (item = util_list_get_first(ConfigDirs); item; item = item->next)
+    {
+      ConfigDir *dir = item->data;
+
+      for (i = 0; i < dir->n_names; i++)
+	free(dir->names[i]);
+
+      free(dir->names);
+      free(dir->path);
+      free(dir);
+    }
+
+  util_list_free(ConfigDirs);
+  ConfigDirs = NULL;
+}
+
+/* Is there a path, going by its directory's listing */
+static boolean
+config_path_exists (const char *path)
+{
+  const char *slash = strrchr(path, '/'), *name;
+  char        dir_path[1024];
+  ConfigDir  *dir;
+
+  if (slash == NULL)
+    return util_file_readable((char *)path);
+
+  if (slash == path)
+    snprintf(dir_path, sizeof(dir_path), "/");
+  else
+    snprintf(dir_path, sizeof(dir_path), "%.*s", (int)(slash - path), path);
+
+  dir  = config_dir_get (dir_path);
+  name = slash + 1;
+
+  if (!dir->listed)
+    return util_file_readable((char *)path);
+
+  return bsearch(&name, dir->names, dir->n_names, sizeof(char *),
+		 config_dir_name_cmp) != NULL;
+}
+
+/* What image paths resolve against, see config_image_path() */
+static void
+config_search_path (char *buf, int len)
+{
+  snprintf(buf, len, "%s:%s/.matchbox", get_assets_dir(), getenv("HOME"));
+}
+
+#if WANT_BUILTIN_LAYOUTS
+/* 
+ * The compiled in copy of path, if its one of the shipped layouts. Not
+ * when pointed at other assets with MB_KBD_ASSETS_DIR.
+*/
+static const MBKeyboardConfigBuiltin*
+config_find_builtin(const char *path)
+{
+  const MBKeyboardConfigBuiltin *builtin;
+  int                            n = strlen(PKGDATADIR);
+
+  if (getenv("MB_KBD_ASSETS_DIR") 
+      || strncmp(path, PKGDATADIR, n) || path[n] != '/')
+    return NULL;
+
+  for (builtin = MBKeyboardConfigBuiltins; builtin->name; builtin++)
+    if (streq(path + n + 1, builtin->name))
+      return builtin;
+
+  return NULL;
+}
+#endif
+
+/* A shipped layout is there whether installed or not */
+static boolean
+config_file_exists(char *path)
+{
+#if WANT_BUILTIN_LAYOUTS
+  if (config_find_builtin(path))
+    return True;
+#endif
+
+  return config_path_exists(path);
+}
+
+static boolean
+config_find_file(MBKeyboard *kbd, char *variant_in)
+{
+  char          *country  = NULL;  
+  char          *variant  = NULL;
+  char          *lang     = NULL;
+  int            n = 0, i = 0;
+  char           path[1024]; 	/* XXX MAXPATHLEN */
+  char* assets_dir = get_assets_dir();
+
+  /* keyboard[-country][-variant].xml */
+
+  /* This is an overide mainly for people developing keyboard layouts  */
+
+  if (getenv("MB_KBD_CONFIG"))
+    {
+      snprintf(path, 1024, "%s", getenv("MB_KBD_CONFIG"));
+
+      DBG("checking %s\n", path);
+
+      if (util_file_readable(path))
+	goto load;
+
+      return False;
+    }
+
+  lang = getenv("MB_KBD_LANG");
+
+  if (lang == NULL)
+    lang = getenv("LANG");
+
+  if (lang)
+    {
+      n = strlen(lang) + 2;
+
+      country = alloca(n);
+
+      snprintf(country, n, "-%s", lang);
+
+      /* strip anything after first '.' */
+      while(country[i] != '\0')
+	if (country[i] == '.')
+	  country[i] = '\0';
+	else
+	  i++;
+    }
+
+  if (variant_in)
+    {
+      n = strlen(variant_in) + 2;
+      variant = alloca(n);
+      snprintf(variant, n, "-%s", variant_in);
+    }
+
+  if (getenv("HOME"))
+    {
+      snprintf(path, 1024, "%s/.matchbox/keyboard.xml", getenv("HOME"));
+
+      DBG("checking %s\n", path);
+
+      if (config_path_exists(path))
+	goto load;
+    }
+
+  /* Hmmm :/ */
+
+  snprintf(path, 1024, "%s/keyboard%s%s.xml",
+	   assets_dir,
+	   country == NULL ? "" : country,
+	   variant == NULL ? "" : variant);
+
+  DBG("checking %s\n", path);
+  
+  if (config_file_exists(path))
+    goto load;
+
+  snprintf(path, 1024, "%s/keyboard%s.xml",
+	   assets_dir,
+	   variant == NULL ? "" : variant);
+
+  DBG("checking %s\n", path);
+
+  if (config_file_exists(path))
+    goto load;
+
+  snprintf(path, 1024, "%s/keyboard%s.xml",
+	   assets_dir,
+	   country == NULL ? "" : country);
+
+  DBG("checking %s\n", path);
+
+  if (config_file_exists(path))
+    goto load;
+
+  snprintf(path, 1024, "%s/keyboard.xml", assets_dir);
+  
+  DBG("checking %s\n", path);
+
+  if (!config_file_exists(path))
+    return False;
+
+ load:
+
+  kbd->config_file = strdup(path);
+
+  return True;
+}
+
+static char* 
+config_load_file(const char *path, struct stat *stat_info)
+{
+  FILE*          fp;
+  char          *result;
+  int            n;
+
+  if ((fp = fopen(path, "rb")) == NULL) 
+    return NULL;
+
+  DBG("loading %s\n", path);
+
+  result = malloc(stat_info->st_size + 1);
+
+  n = fread(result, 1, stat_info->st_size, fp);
+
+  if (n >= 0) result[n] = '\0';
+  
+  fclose(fp);
+
+  return result;
+}
+
+/* What the layouts are built from, kept for building them later on */
+struct MBKeyboardConfigSource
+{
+  MBKeyboardConfigOps    ops;
+  void                  *map;	/* the cache mmap'd, */
+  MBKeyboardConfigCache *cache;	/* parsed, or neither for a builtin */
+};
+
+static void
+config_source_free(MBKeyboardConfigSource *source)
+{
+  if (source->map)
+    mb_kbd_config_cache_unmap(source->map);
+
+  if (source->cache)
+    mb_kbd_config_cache_free(source->cache);
+
+  free(source);
+}
+
+/* Where an image face given as val is loaded from */
+static void
+config_image_path(const char *val, char *buf, int len)
+{
+  if (val[0] == '/')
+    {
+      snprintf(buf, len, "%s", val);
+      return;
+    }
+
+  /* Relative, rather than absolute path, try pkddatadir and home */
+  snprintf(buf, len, "%s/%s", get_assets_dir(), val);
+
+  if (!config_path_exists(buf))
+    snprintf(buf, len, "%s/.matchbox/%s", getenv("HOME"), val);
+}
+
+/*
+ * Resolves every image face in a freshly parsed cache, the path going in
+ * the op's value. Saved along with the rest, next start needs no looking.
+*/
+static void
+config_resolve_images(MBKeyboardConfigCache *cache)
+{
+  MBKeyboardConfigOps ops;
+  char                buf[512];
+  int                 i;
+
+  mb_kbd_config_cache_get_ops(cache, &ops);
+
+  for (i = 0; i < ops.n_ops; i++)
+    if (ops.ops[i].type == MBKeyboardConfigOpImageFace)
+      {
+	config_image_path(ops.strings + ops.ops[i].str, buf, sizeof(buf));
+	mb_kbd_config_cache_set_value_str(cache, i, buf);
+
+	/* Which may have moved the strings */
+	mb_kbd_config_cache_get_ops(cache, &ops);
+      }
+}
+
+/* Where the image face at ops[i] is loaded from */
+static const char*
+config_op_image_path(const MBKeyboardConfigOps *ops, int i, char *buf, int len)
+{
+  if (ops->ops[i].value)	/* see config_resolve_images() */
+    return ops->strings + ops->ops[i].value;
+
+  config_image_path(ops->strings + ops->ops[i].str, buf, len);
+
+  return buf;
+}
+
+static MBKeyboardImage*
+config_load_image(MBKeyboard *kbd, const char *path)
+{
+  mb_kbd_config_watch_add(kbd->config_watch, path);
+
+  return mb_kbd_image_new (kbd, path);
+}
+
+/* End of the layout starting at ops[start] */
+static int
+config_layout_end(const MBKeyboardConfigOps *ops, int start)
+{
+  int i;
+
+  for (i = start + 1; i < ops->n_ops; i++)
+    if (ops->ops[i].type == MBKeyboardConfigOpLayout)
+      break;
+
+  return i;
+}
+
+/* End of the row or key at ops[start], what follows a key being its own */
+static int
+config_key_end(const MBKeyboardConfigOps *ops, int start, int end)
+{
+  int i;
+
+  for (i = start + 1; i < end; i++)
+    if (ops->ops[i].type == MBKeyboardConfigOpRow
+	|| ops->ops[i].type == MBKeyboardConfigOpKey)
+      break;
+
+  return i;
+}
+
+/* Builds the key at ops[start], its faces and actions up to end */
+static MBKeyboardKey*
+config_build_key (MBKeyboard                *kbd,
+		  const MBKeyboardConfigOps *ops,
+		  int                        start,
+		  int                        end)
+{
+  const MBKeyboardConfigOp *op = &ops->ops[start];
+  MBKeyboardKey            *key;
+  MBKeyboardImage          *img;
+  char                      buf[512];
+  int                       i;
+
+  key = mb_kbd_key_new(kbd);
+
+  if (op->flags & MBKeyboardConfigKeyObeyCaps)
+    mb_kbd_key_set_obey_caps(key, True);
+  if (op->flags & MBKeyboardConfigKeyExtended)
+    mb_kbd_key_set_extended(key, True);
+  if (op->value > 0)
+    mb_kbd_key_set_req_uwidth(key, op->value);
+  if (op->flags & MBKeyboardConfigKeyFill)
+    mb_kbd_key_set_fill(key, True);
+  if (op->flags & MBKeyboardConfigKeyBlank)
+    mb_kbd_key_set_blank(key, True);
+
+  for (i = start + 1; i < end; i++)
+    {
+      const char *str;
+
+      op  = &ops->ops[i];
+      str = ops->strings + op->str;
+
+      switch (op->type)
+	{
+	case MBKeyboardConfigOpGlyphFace:
+	  mb_kbd_key_set_glyph_face(key, op->state, str);
+	  break;
+	case MBKeyboardConfigOpImageFace:
+	  img = config_load_image (kbd, config_op_image_path (ops, i, buf,
+							     sizeof(buf)));
+	  /* 
+	   * Layouts are built as first shown, long after startup checked
+	   * the file was there, so a bad one just leaves the key blank.
+	  */
+	  if (img == NULL)
+	    {
+	      fprintf(stderr, "matchbox-keyboard: *Warning* Failed to load "
+		      "'%s'\n", str);
+	      mb_kbd_key_set_glyph_face(key, op->state, "");
+	      break;
+	    }
+	  mb_kbd_key_set_image_face(key, op->state, img);
+	  break;
+	case MBKeyboardConfigOpCharAction:
+	  mb_kbd_key_set_char_action(key, op->state, str);
+	  break;
+	case MBKeyboardConfigOpKeysymAction:
+	  mb_kbd_key_set_keysym_action(key, op->state, op->value);
+	  break;
+	case MBKeyboardConfigOpModifierAction:
+	  mb_kbd_key_set_modifer_action(key, op->state, op->value);
+	  break;
+	case MBKeyboardConfigOpStringAction:
+	  mb_kbd_key_set_string_action(key, op->state, str);
+	  break;
+	default:
+	  break;
+	}
+    }
+
+  return key;
+}
+
+/* Builds a layout's rows and keys from ops [start, end) */
+static void
+config_build_rows (MBKeyboard                *kbd,
+		   MBKeyboardLayout          *layout,
+		   const MBKeyboardConfigOps *ops,
+		   int                        start,
+		   int                        end)
+{
+  MBKeyboardRow *row = NULL;
+  int            i, next;
+
+  /* Rows always come before keys, see config_cache_ops_valid() */
+  for (i = start; i < end; i = next)
+    {
+      next = config_key_end(ops, i, end);
+
+      if (ops->ops[i].type == MBKeyboardConfigOpRow)
+	{
+	  row = mb_kbd_row_new(kbd);
+	  mb_kbd_layout_append_row(layout, row);
+	}
+      else
+	mb_kbd_row_append_key(row, config_build_key (kbd, ops, i, next));
+    }
+}
+
+/* 
+ * Adds the layouts in source to the keyboard, none of them built yet.
+ * Every image they show has to be there though, as it did when they
+ * were all built at startup, see config_build_key().
+*/
+static void
+config_replay (MBKeyboard             *kbd,
+	       MBKeyboardConfigSource *source)
+{
+  MBKeyboardLayout *layout;
+  char              buf[512];
+  int               start, end, i;
+
+  for (i = 0; i < source->ops.n_ops; i++)
+    if (source->ops.ops[i].type == MBKeyboardConfigOpImageFace
+	&& !config_path_exists (config_op_image_path (&source->ops, i, buf,
+						      sizeof(buf))))
+      {
+	fprintf(stderr, "matchbox-keyboard: Failed to load '%s'\n", 
+		source->ops.strings + source->ops.ops[i].str);
+	util_fatal_error("Error loading layout\n");
+      }
+
+  for (start = 0; start < source->ops.n_ops; start = end)
+    {
+      end = config_layout_end(&source->ops, start);
+
+      layout = mb_kbd_layout_new(kbd, source->ops.strings 
+				      + source->ops.ops[start].str);
+      mb_kbd_layout_set_ops(layout, &source->ops, start + 1, end);
+      mb_kbd_add_layout(kbd, layout);
+    }
+
+  kbd->config_source = source;
+}
+
+/* Appends the image paths ops [start, end) show to paths */
+static List*
+config_image_paths (const MBKeyboardConfigOps *ops,
+		    int                        start,
+		    int                        end,
+		    List                      *paths)
+{
+  char buf[512];
+  int  i;
+
+  for (i = start; i < end; i++)
+    if (ops->ops[i].type == MBKeyboardConfigOpImageFace)
+      {
+	paths = util_list_append(paths,
+				 strdup(config_op_image_path (ops, i, buf,
+							      sizeof(buf))));
+      }
+
+  return paths;
+}
+
+static void
+config_free_paths (List *paths)
+{
+  List *item;
+
+  for (item = util_list_get_first(paths); item; item = item->next)
+    free(item->data);
+
+  util_list_free(paths);
+}
+
+static void
+config_free_images (List *images)
+{
+  List *item;
+
+  for (item = util_list_get_first(images); item; item = item->next)
+    mb_kbd_image_destroy(item->data);
+
+  util_list_free(images);
+}
+
+/* Decodes the images for ops [start, end) together, see mb_kbd_image_preload() */
+static List*
+config_preload_images (MBKeyboard                *kbd,
+		       const MBKeyboardConfigOps *ops,
+		       int                        start,
+		       int                        end)
+{
+  List *paths, *images;
+
+  paths  = config_image_paths (ops, start, end, NULL);
+  images = mb_kbd_image_preload (kbd, paths);
+
+  config_free_paths (paths);
+
+  return images;
+}
+
+void
+mb_kbd_config_realize_layout(MBKeyboard *kbd, MBKeyboardLayout *layout)
+{
+  const MBKeyboardConfigOps *ops;
+  List                      *images;
+  int                        start, end;
+
+  if (mb_kbd_layout_is_built(layout))
+    return;
+
+  ops = mb_kbd_layout_get_ops(layout, &start, &end);
+
+  DBG("building layout %s, ops %i to %i", mb_kbd_layout_id(layout), start, end);
+
+  images = config_preload_images (kbd, ops, start, end);
+
+  mb_kbd_startup_mark (MBKeyboardStartupImageDecode);
+
+  config_build_rows (kbd, layout, ops, start, end);
+  mb_kbd_layout_set_built(layout, True);
+
+  /* The keys hold their own references by now */
+  config_free_images (images);
+}
+
+static boolean
+config_ops_equal (const MBKeyboardConfigOps *a, int a_start, int a_end,
+		  const MBKeyboardConfigOps *b, int b_start, int b_end)
+{
+  int i;
+
+  if (a_end - a_start != b_end - b_start)
+    return False;
+
+  for (i = 0; i < a_end - a_start; i++)
+    {
+      const MBKeyboardConfigOp *x = &a->ops[a_start + i];
+      const MBKeyboardConfigOp *y = &b->ops[b_start + i];
+
+      if (x->type != y->type || x->state != y->state
+	  || x->flags != y->flags
+	  || !streq(a->strings + x->str, b->strings + y->str))
+	return False;
+
+      /* An image face's value is its resolved path, as a string */
+      if (x->type == MBKeyboardConfigOpImageFace
+	  ? !streq(a->strings + x->value, b->strings + y->value)
+	  : x->value != y->value)
+	return False;
+    }
+
+  return True;
+}
+
+/* The same rows holding the same keys, as far as geometry goes */
+static boolean
+config_ops_same_shape (const MBKeyboardConfigOps *a, int a_start, int a_end,
+		       const MBKeyboardConfigOps *b, int b_start, int b_end)
+{
+  int i = a_start, j = b_start;
+
+  while (i < a_end && j < b_end)
+    {
+      if (!config_ops_equal (a, i, i + 1, b, j, j + 1))
+	return False;
+
+      i = config_key_end(a, i, a_end);
+      j = config_key_end(b, j, b_end);
+    }
+
+  return i == a_end && j == b_end;
+}
+
+/* Does the key at ops [start, end) show any of the image files */
+static boolean
+config_key_shows (const MBKeyboardConfigOps *ops, 
+		  int                        start,
+		  int                        end,
+		  List                      *images)
+{
+  char  buf[512];
+  List *item;
+  int   i;
+
+  for (i = start; i < end && images; i++)
+    if (ops->ops[i].type == MBKeyboardConfigOpImageFace)
+      {
+	const char *path = config_op_image_path (ops, i, buf, sizeof(buf));
+
+	for (item = util_list_get_first(images); item; item = item->next)
+	  if (streq(path, item->data))
+	    return True;
+      }
+
+  return False;
+}
+
+/*
+ * Replaces each key in layout whose ops differ in ops [start, end), the
+ * same shape, or that shows a changed image. The new key gets the old
+ * one's geometry so nothing needs reallocating, and is added to changed.
+*/
+static List*
+config_update_keys (MBKeyboard                *kbd,
+		    MBKeyboardLayout          *layout,
+		    const MBKeyboardConfigOps *ops,
+		    int                        start,
+		    int                        end,
+		    List                      *images,
+		    List                      *changed)
+{
+  const MBKeyboardConfigOps *old;
+  List                      *row_item = NULL, *key_item = NULL;
+  int                        i, j, next, old_next, old_start, old_end;
+
+  old = mb_kbd_layout_get_ops(layout, &old_start, &old_end);
+
+  for (i = start, j = old_start; i < end; i = next, j = old_next)
+    {
+      MBKeyboardKey *key, *old_key;
+
+      next     = config_key_end(ops, i, end);
+      old_next = config_key_end(old, j, old_end);
+
+      if (ops->ops[i].type == MBKeyboardConfigOpRow)
+	{
+	  row_item = row_item ? util_list_next(row_item) 
+	                      : mb_kbd_layout_rows(layout);
+	  key_item = NULL;
+	  continue;
+	}
+
+      key_item = key_item ? util_list_next(key_item) 
+	                  : mb_kdb_row_keys(row_item->data);
+
+      if (config_ops_equal (old, j, old_next, ops, i, next)
+	  && !config_key_shows (ops, i, next, images))
+	continue;
+
+      old_key = key_item->data;
+      key     = config_build_key (kbd, ops, i, next);
+
+      mb_kbd_key_set_geometry(key, 
+			      mb_kbd_key_x(old_key), 
+			      mb_kbd_key_y(old_key),
+			      mb_kbd_key_width(old_key) 
+			        - mb_kbd_key_get_extra_width_pad(old_key),
+			      mb_kbd_key_height(old_key)
+			        - mb_kbd_key_get_extra_height_pad(old_key));
+      mb_kbd_key_set_extra_width_pad(key, 
+				     mb_kbd_key_get_extra_width_pad(old_key));
+      mb_kbd_key_set_extra_height_pad(key, 
+				      mb_kbd_key_get_extra_height_pad(old_key));
+
+      mb_kbd_row_replace_key(row_item->data, old_key, key);
+      mb_kbd_key_destroy(old_key);
+
+      changed = util_list_append(changed, key);
+    }
+
+  return changed;
+}
+
+/*
+ * Loads the images config_update() is about to build keys with, those of
+ * the layouts built now and of the first one, which is selected if the
+ * current one has gone, into *images for the caller to destroy once
+ * done. False if any fail, with nothing touched, so a half written icon
+ * can't take the keyboard down.
+*/
+static boolean
+config_update_preload (MBKeyboard             *kbd,
+		       MBKeyboardConfigSource *source,
+		       List                  **images)
+{
+  const MBKeyboardConfigOps *ops = &source->ops;
+  MBKeyboardImage           *img;
+  List                      *paths = NULL, *item;
+  boolean                    loaded = True;
+  int                        start, end;
+
+  for (start = 0; start < ops->n_ops; start = end)
+    {
+      const char *id = ops->strings + ops->ops[start].str;
+      boolean     built = (start == 0);
+
+      end = config_layout_end(ops, start);
+
+      for (item = util_list_get_first(kbd->layouts); item; item = item->next)
+	if (streq(mb_kbd_layout_id(item->data), id)
+	    && mb_kbd_layout_is_built(item->data))
+	  built = True;
+
+      if (built)
+	paths = config_image_paths (ops, start + 1, end, paths);
+    }
+
+  *images = mb_kbd_image_preload (kbd, paths);
+
+  /* Just lookups for those that loaded, watched so a fix gets noticed */
+  for (item = util_list_get_first(paths); item; item = item->next)
+    {
+      if ((img = config_load_image (kbd, item->data)) == NULL)
+	{
+	  fprintf(stderr, "matchbox-keyboard: Failed to load '%s', "
+		  "keeping the current layouts\n", (char *)item->data);
+	  loaded = False;
+	  break;
+	}
+
+      mb_kbd_image_destroy(img);
+    }
+
+  config_free_paths (paths);
+
+  if (!loaded)
+    {
+      config_free_images (*images);
+      *images = NULL;
+    }
+
+  return loaded;
+}
+
+/*
+ * Brings the keyboard in line with source, the config file as it now is,
+ * and any images changed. Layouts are matched up by id. Those with the
+ * same shape just get any changed keys replaced, the rest are rebuilt
+ * from scratch when next needed.
+*/
+static void
+config_update (MBKeyboard             *kbd,
+	       MBKeyboardConfigSource *source,
+	       List                   *images)
+{
+  const MBKeyboardConfigOps *ops = &source->ops;
+  MBKeyboardLayout          *selected = NULL;
+  List                      *layouts = NULL, *changed = NULL, *item;
+  boolean                    relayout = False;
+  int                        start, end;
+
+  for (start = 0; start < ops->n_ops; start = end)
+    {
+      const MBKeyboardConfigOps *old;
+      MBKeyboardLayout          *layout = NULL;
+      const char                *id = ops->strings + ops->ops[start].str;
+      int                        old_start, old_end;
+      boolean                    was_selected;
+
+      end = config_layout_end(ops, start);
+
+      /* Taken out as matched, in case of repeated ids */
+      for (item = util_list_get_first(kbd->layouts); item; item = item->next)
+	if (item->data && streq(mb_kbd_layout_id(item->data), id))
+	  {
+	    layout = item->data;
+	    item->data = NULL;
+	    break;
+	  }
+
+      was_selected = (layout && layout == kbd->selected_layout);
+
+      if (layout && mb_kbd_layout_is_built(layout))
+	{
+	  old = mb_kbd_layout_get_ops(layout, &old_start, &old_end);
+
+	  if (config_ops_same_shape (old, old_start, old_end,
+				     ops, start + 1, end))
+	    {
+	      List *keys;
+
+	      keys = config_update_keys (kbd, layout, ops, start + 1, end,
+					 images, NULL);
+	      if (was_selected)
+		changed = keys;
+	      else
+		util_list_free(keys);
+	    }
+	  else
+	    {
+	      DBG("layout %s changed shape, rebuilding", id);
+
+	      mb_kbd_layout_destroy(layout);
+	      layout = NULL;
+	    }
+	}
+
+      if (layout == NULL)
+	{
+	  layout = mb_kbd_layout_new(kbd, id);
+	  relayout |= was_selected;
+	}
+
+      if (was_selected)
+	selected = layout;
+
+      mb_kbd_layout_set_ops(layout, ops, start + 1, end);
+      layouts = util_list_append(layouts, layout);
+    }
+
+  /* Whatever is left has gone from the file */
+  for (item = util_list_get_first(kbd->layouts); item; item = item->next)
+    if (item->data)
+      mb_kbd_layout_destroy(item->data);
+
+  util_list_free(kbd->layouts);
+  kbd->layouts = layouts;
+
+  if (selected == NULL)
+    {
+      selected = util_list_get_nth_data(layouts, 0);
+      relayout = True;
+    }
+
+  kbd->selected_layout = selected;
+  mb_kbd_config_realize_layout(kbd, selected);
+
+  mb_kbd_ui_handle_layout_change(kbd->ui, relayout, changed);
+
+  util_list_free(changed);
+}
+
+/*
+ * Rebuilds what has changed after the config file ( if config ) or any 
+ * of the image files listed have been written to. See config-watch.c
+*/
+void
+mb_kbd_config_reload(MBKeyboard *kbd, boolean config, List *images)
+{
+  MBKeyboardConfigSource *source = kbd->config_source;
+  MBKeyboardConfigCache  *cache;
+  struct stat             stat_info;
+  List                   *item, *loaded;
+  char                   *data, search[1024];
+
+  /* Files may have come or gone since the listings were read */
+  config_dirs_forget();
+
+  if (config || ConfigReloadPending)
+    {
+      if (stat(kbd->config_file, &stat_info)
+	  || (data = config_load_file(kbd->config_file, &stat_info)) == NULL)
+	return;
+
+      cache = mb_kbd_config_parse(kbd->config_file, data);
+      free(data);
+
+      if (cache == NULL)
+	{
+	  fprintf(stderr, "matchbox-keyboard: keeping the current layouts\n");
+	  return;
+	}
+
+      source = util_malloc0(sizeof(MBKeyboardConfigSource));
+      source->cache = cache;
+
+      config_resolve_images(cache);
+      config_search_path(search, sizeof(search));
+
+      mb_kbd_config_cache_save(cache, kbd->config_file, &stat_info, search);
+      mb_kbd_config_cache_get_ops(cache, &source->ops);
+
+      if (source->ops.n_ops == 0)
+	{
+	  fprintf(stderr, "matchbox-keyboard: %s has no layouts, "
+		  "keeping the current ones\n", kbd->config_file);
+	  config_source_free(source);
+	  return;
+	}
+
+      DBG("reloading %s", kbd->config_file);
+    }
+
+  for (item = util_list_get_first(images); item; item = item->next)
+    mb_kbd_image_invalidate (item->data);
+
+  /* Fixing the image then needs to bring in the new file too */
+  if (!config_update_preload (kbd, source, &loaded))
+    {
+      if (source != kbd->config_source)
+	{
+	  config_source_free(source);
+	  ConfigReloadPending = True;
+	}
+      return;
+    }
+
+  ConfigReloadPending = False;
+
+  config_update (kbd, source, images);
+  config_free_images (loaded);
+
+  /* Nothing points into the old one now */
+  if (source != kbd->config_source)
+    {
+      config_source_free(kbd->config_source);
+      kbd->config_source = source;
+    }
+}
+
+int
+mb_kbd_config_load(MBKeyboard *kbd, char *variant)
+{
+  MBKeyboardConfigSource *source;
+  struct stat             stat_info;
+  char                   *data, search[1024];
+
+  if (!config_find_file(kbd, variant))
+    util_fatal_error("Couldn't find a keyboard config file\n");
+
+  if (variant && !strstr(kbd->config_file, variant))
+    fprintf(stderr, 
+	    "matchbox-keyboard: *Warning* Unable to locate variant: %s\n"
+	    "                   falling back to %s\n",
+	    variant, kbd->config_file);
+
+  kbd->config_watch = mb_kbd_config_watch_new(kbd->config_file);
+
+  source = util_malloc0(sizeof(MBKeyboardConfigSource));
+
+#if WANT_BUILTIN_LAYOUTS
+  {
+    const MBKeyboardConfigBuiltin *builtin;
+
+    if ((builtin = config_find_builtin(kbd->config_file)) != NULL)
+      {
+	DBG("using builtin %s", builtin->name);
+	source->ops = builtin->ops;
+	config_replay (kbd, source);
+	return 1;
+      }
+  }
+#endif
+
+  if (stat(kbd->config_file, &stat_info))
+    util_fatal_error("Couldn't find a keyboard config file\n");
+
+  config_search_path(search, sizeof(search));
+
+  /* Unchanged since last time, skip the XML altogether */
+  if ((source->map = mb_kbd_config_cache_map(kbd->config_file, &stat_info, 
+					     search, &source->ops)))
+    {
+      config_replay (kbd, source);
+      return 1;
+    }
+
+  if ((data = config_load_file(kbd->config_file, &stat_info)) == NULL)
+    util_fatal_error("Couldn't find a keyboard config file\n");
+
+  if ((source->cache = mb_kbd_config_parse(kbd->config_file, data)) == NULL)
+    util_fatal_error("Error parsing\n");
+
+  free(data);
+
+  config_resolve_images(source->cache);
+
+  /* Saving adds to the strings, so the ops are only taken after */
+  mb_kbd_config_cache_save(source->cache, kbd->config_file, &stat_info,
+			   search);
+  mb_kbd_config_cache_get_ops(source->cache, &source->ops);
+
+  config_replay (kbd, source);
+
+  return 1;
+}
@@ -0,0 +1,86 @@
+/*
+ *  Matchbox Keyboard - A lightweight software keyboard.
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2, or (at your option)
+ *  any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ */
+
+#ifndef HAVE_MBKB_CONFIG_NAMES_H
+#define HAVE_MBKB_CONFIG_NAMES_H
+
+/*
+ * Shared with names-compiler.c, which is built for the build machine,
+ * so nothing here may need X or the rest of the keyboard.
+*/
+
+/*
+ * Names the parser looks up, as minimal perfect hash tables generated at
+ * build time, see names-compiler.c. A name's only candidate is
+ *
+ *   names[MB_KBD_CONFIG_NAME_SLOT(h, displace[util_hash_mix(h) % n_buckets], n)]
+ *
+ * h being util_hash_str() of it, so one hash and one compare either way.
+*/
+typedef enum
+{
+  MBKeyboardConfigTagLayout = 1,
+  MBKeyboardConfigTagRow,
+  MBKeyboardConfigTagKey,
+  MBKeyboardConfigTagSpace,
+  MBKeyboardConfigTagState,	/* see MBKeyboardConfigStates */
+}
+MBKeyboardConfigTag;
+
+typedef struct MBKeyboardConfigName
+{
+  const char    *name;
+  unsigned int   value;
+}
+MBKeyboardConfigName;
+
+typedef struct MBKeyboardConfigNames
+{
+  const MBKeyboardConfigName *names;
+  const unsigned short       *displace;
+  unsigned int                n, n_buckets;
+}
+MBKeyboardConfigNames;
+
+#define MB_KBD_CONFIG_NAME_SLOT(h,d,n) \
+  (util_hash_mix((h) + (d) * 0x9e3779b9u) % (n))
+
+extern const MBKeyboardConfigNames MBKeyboardConfigTags;      /* MBKeyboardConfigTag */
+extern const MBKeyboardConfigNames MBKeyboardConfigStates;    /* MBKeyboardKeyStateType */
+extern const MBKeyboardConfigNames MBKeyboardConfigModifiers; /* MBKeyboardKeyModType */
+extern const MBKeyboardConfigNames MBKeyboardConfigActions;   /* keysyms, eg backspace */
+extern const MBKeyboardConfigNames MBKeyboardConfigKeysyms;   /* XK_ names, sans XK_ */
+
+/*
+ * Legacy keysyms with a character, from the U+ notes in the same headers,
+ * sorted by keysym. Latin-1 and 'Unicode' keysyms need no table.
+*/
+typedef struct MBKeyboardKeysymUcs4
+{
+  unsigned int   keysym;
+  unsigned int   ucs4;
+}
+MBKeyboardKeysymUcs4;
+
+extern const MBKeyboardKeysymUcs4 MBKeyboardKeysymsUcs4[];
+extern const unsigned int         MBKeyboardKeysymsUcs4Count;
+
+unsigned int
+util_hash_str(const char *str);
+
+unsigned int
+util_hash_mix(unsigned int hash);
+
+#endif
@@ -44,6 +44,7 @@
 	     action="string"       // from lookup below
 	     action="modifier:Shift|Alt|ctrl|mod1|mod2|mod3|caps|layout"
 	     action="xkeysym:XK_BLAH"
+	     action="string:Some text"  // typed in one go
 	  <shifted 
 	     ...... >
 	  <mod1
@@ -60,91 +61,20 @@
     </keyboard>
 */
 
-struct _keysymlookup
-{
-  KeySym keysym;   char *name;  
-} 
-MBKeyboardKeysymLookup[] =
-{
- { XK_BackSpace,   "backspace" },
- { XK_Tab,	   "tab"       },
- { XK_Linefeed,    "linefeed"  },
- { XK_Clear,       "clear"     },	
- { XK_Return,      "return"    },
- { XK_Pause,       "pause" },	
- { XK_Scroll_Lock, "scrolllock" },	
- { XK_Sys_Req,     "sysreq" },
- { XK_Escape,      "escape" },	
- { XK_Delete,      "delete" },	
- { XK_Home,        "home" },
- { XK_Insert,        "insert" },
- { XK_Left,        "left" },
- { XK_Up,          "up"   },
- { XK_Right,       "right" },
- { XK_Down,        "down"  },
- { XK_Prior,       "prior" },		
- { XK_Page_Up,     "pageup" },	
- { XK_Next,        "next"   },
- { XK_Page_Down,   "pagedown" },
- { XK_End,         "end" },
- { XK_Begin,	   "begin" },
- { XK_space,        "space" },
- { XK_F1,          "f1" },
- { XK_F2,          "f2" },
- { XK_F3,          "f3" },
- { XK_F4,          "f4" },
- { XK_F5,          "f5" },
- { XK_F6,          "f6" },
- { XK_F7,          "f7" },
- { XK_F8,          "f8" },
- { XK_F9,          "f9" },
- { XK_F10,         "f10" },
- { XK_F11,         "f11" },
-
- // Xlab: Additional F-keys
- { XK_F12,         "f12" },
- { XK_F13,         "f13" },
- { XK_F14,         "f14" },
- { XK_F15,         "f15" },
- { XK_F16,         "f16" },
- { XK_F17,         "f17" },
- { XK_F18,         "f18" },
- { XK_F19,         "f19" },
- { XK_F20,         "f20" }
-};
-
-struct _modlookup
-{
-  char *name; MBKeyboardKeyModType type;
-}
-ModLookup[] =
-{
-  { "shift",   MBKeyboardKeyModShift },
-  { "alt",     MBKeyboardKeyModAlt },
-  { "ctrl",    MBKeyboardKeyModControl },
-  { "control", MBKeyboardKeyModControl },
-  { "mod1",    MBKeyboardKeyModMod1 },
-  { "mod2",    MBKeyboardKeyModMod2 },
-  { "mod3",    MBKeyboardKeyModMod3 },
-  { "caps",    MBKeyboardKeyModCaps },
-  
-  // Xlab: Layout switch support
-  { "layout",    MBKeyboardKeyModLayout },
-
-  // Xlab: Hide keyboard key support
-  { "min",    MBKeyboardKeyModMin }
-};
+/*
+ * Tag, key state, modifier and keysym names are all looked up in tables
+ * generated at build time, see names-compiler.c
+*/
 
 typedef struct MBKeyboardConfigState
 {
-  MBKeyboard       *keyboard;
-  MBKeyboardLayout *current_layout;
-  MBKeyboardRow    *current_row;
-  MBKeyboardKey    *current_key;
+  const char       *path;
+  Bool              in_layout, in_row, in_key;
   Bool              error;
   char             *error_msg;
   int               error_lineno;
   XML_Parser        parser;
+  MBKeyboardConfigCache *cache; /* what to build, see config-loader.c */
 }
 MBKeyboardConfigState;
 
@@ -156,16 +86,40 @@ set_error(MBKeyboardConfigState *state, char *msg)
   state->error_msg = msg;
 }
 
+/* Sets value to what str maps to in names, False if it isnt there */
+static boolean
+config_lookup(const MBKeyboardConfigNames *names,
+	      const char                  *str,
+	      unsigned int                *value)
+{
+  const MBKeyboardConfigName *name;
+  unsigned int                hash;
+
+  /* Only ever the keysyms, built with --disable-keysym-table */
+  if (names->n == 0)
+    return False;
+
+  hash = util_hash_str(str);
+  name = &names->names[MB_KBD_CONFIG_NAME_SLOT(hash,
+		names->displace[util_hash_mix(hash) % names->n_buckets],
+		names->n)];
+
+  if (!streq(name->name, str))
+    return False;
+
+  *value = name->value;
+  return True;
+}
+
 KeySym
 config_str_to_keysym(const char* str)
 {
-  int i;
+  unsigned int keysym;
 
   DBG("checking %s", str);
 
-  for (i=0; i<sizeof(MBKeyboardKeysymLookup)/sizeof(struct _keysymlookup); i++)
-    if (streq(str, MBKeyboardKeysymLookup[i].name))
-      return MBKeyboardKeysymLookup[i].keysym;
+  if (config_lookup(&MBKeyboardConfigActions, str, &keysym))
+    return keysym;
 
   DBG("didnt find it %s", str);
 
@@ -175,149 +129,28 @@ config_str_to_keysym(const char* str)
 MBKeyboardKeyModType
 config_str_to_modtype(const char* str)
 {
-  int i;
+  unsigned int type;
 
-  for (i=0; i<sizeof(ModLookup)/sizeof(struct _modlookup); i++)
-    {
-      DBG("checking '%s' vs '%s'", str, ModLookup[i].name);
-      if (streq(str, ModLookup[i].name))
-	return ModLookup[i].type;
-    }
+  if (config_lookup(&MBKeyboardConfigModifiers, str, &type))
+    return type;
 
   return 0;
 }
 
-static char*
-get_assets_dir() {
-  char* assets_dir = getenv("MB_KBD_ASSETS_DIR");
-  return assets_dir ? assets_dir : PKGDATADIR;
-}
-
-static char* 
-config_load_file(MBKeyboard *kbd, char *variant_in)
+/* Any X keysym name, with or without its XK_ */
+static KeySym
+config_xkeysym(const char* str)
 {
-  struct stat    stat_info;
-  FILE*          fp;
-  char          *result;
-  char          *country  = NULL;  
-  char          *variant  = NULL;
-  char          *lang     = NULL;
-  int            n = 0, i = 0;
-  char           path[1024]; 	/* XXX MAXPATHLEN */
-  char* assets_dir = get_assets_dir();
-
-  /* keyboard[-country][-variant].xml */
-
-  /* This is an overide mainly for people developing keyboard layouts  */
-
-  if (getenv("MB_KBD_CONFIG"))
-    {
-      snprintf(path, 1024, "%s", getenv("MB_KBD_CONFIG"));
-
-      DBG("checking %s\n", path);
-
-      if (util_file_readable(path))
-	goto load;
-
-      return NULL;
-    }
-
-  lang = getenv("MB_KBD_LANG");
-
-  if (lang == NULL)
-    lang = getenv("LANG");
-
-  if (lang)
-    {
-      n = strlen(lang) + 2;
-
-      country = alloca(n);
-
-      snprintf(country, n, "-%s", lang);
-
-      /* strip anything after first '.' */
-      while(country[i] != '\0')
-	if (country[i] == '.')
-	  country[i] = '\0';
-	else
-	  i++;
-    }
-
-  if (variant_in)
-    {
-      n = strlen(variant_in) + 2;
-      variant = alloca(n);
-      snprintf(variant, n, "-%s", variant_in);
-    }
-
-  if (getenv("HOME"))
-    {
-      snprintf(path, 1024, "%s/.matchbox/keyboard.xml", getenv("HOME"));
-
-      DBG("checking %s\n", path);
-
-      if (util_file_readable(path))
-	goto load;
-    }
-
-  /* Hmmm :/ */
-
-  snprintf(path, 1024, "%s/keyboard%s%s.xml",
-	   assets_dir,
-	   country == NULL ? "" : country,
-	   variant == NULL ? "" : variant);
-
-  DBG("checking %s\n", path);
-  
-  if (util_file_readable(path))
-    goto load;
-
-  snprintf(path, 1024, "%s/keyboard%s.xml",
-	   assets_dir,
-	   variant == NULL ? "" : variant);
-
-  DBG("checking %s\n", path);
-
-  if (util_file_readable(path))
-    goto load;
-
-  snprintf(path, 1024, "%s/keyboard%s.xml",
-	   assets_dir,
-	   country == NULL ? "" : country);
-
-  DBG("checking %s\n", path);
-
-  if (util_file_readable(path))
-    goto load;
-
-  snprintf(path, 1024, "%s/keyboard.xml", assets_dir);
-  
-  DBG("checking %s\n", path);
-
-  if (!util_file_readable(path))
-    return NULL;
-
- load:
-
-  if (stat(path, &stat_info)) 
-    return NULL;
-
-  if ((fp = fopen(path, "rb")) == NULL) 
-    return NULL;
-
-  DBG("loading %s\n", path);
-
-  kbd->config_file = strdup(path);
-
-  result = malloc(stat_info.st_size + 1);
+  unsigned int keysym;
 
-  n = fread(result, 1, stat_info.st_size, fp);
+  if (!strncmp(str, "XK_", 3))
+    str += 3;
 
-  if (n >= 0) result[n] = '\0';
-  
-  fclose(fp);
+  if (config_lookup(&MBKeyboardConfigKeysyms, str, &keysym))
+    return keysym;
 
-  return result;
+  /* Not a name in the headers, eg U20AC or 0x20ac, so over to Xlib */
+  return XStringToKeysym(str);
 }
 
 static const char *
@@ -341,34 +174,17 @@ config_handle_key_subtag(MBKeyboardConfigState *state,
 			 const char            *tag,
 			 const char           **attr)
 {
-  MBKeyboardKeyStateType keystate;
+  unsigned int           keystate; /* MBKeyboardKeyStateType */
   const char            *val;
   KeySym                 found_keysym;
-  char* assets_dir = get_assets_dir();
 
-  /* TODO: Fix below with a lookup table 
-   */
-  if (streq(tag, "normal") || streq(tag, "default"))
-    {
-      keystate = MBKeyboardKeyStateNormal;
-    }
-  else if (streq(tag, "shifted"))
-    {
-      keystate = MBKeyboardKeyStateShifted;
-    }
-  else if (streq(tag, "mod1"))
-    {
-      keystate = MBKeyboardKeyStateMod1;
-    }
-  else if (streq(tag, "mod2"))
-    {
-      keystate = MBKeyboardKeyStateMod2;
-    }
-  else if (streq(tag, "mod3"))
+  if (!state->in_key)
     {
-      keystate = MBKeyboardKeyStateMod3;
+      set_error(state, "Key state outside of a key");
+      return;
     }
-  else
+
+  if (!config_lookup(&MBKeyboardConfigStates, tag, &keystate))
     {
       set_error(state, "Unknown key subtag");
       return;
@@ -380,38 +196,13 @@ config_handle_key_subtag(MBKeyboardConfigState *state,
       return;
     }
 
+  /* Images are looked for and loaded when built, paths may be relative */
   if (!strncmp(val, "image:", 6))
-    {
-      MBKeyboardImage *img;
-
-
-      if (val[6] != '/')
-	{
-	  /* Relative, rather than absolute path, try pkddatadir and home */
-	  char buf[512];
-	  snprintf(buf, 512, "%s/%s", assets_dir, &val[6]);
-
-	  if (!util_file_readable(buf))
-	    snprintf(buf, 512, "%s/.matchbox/%s", getenv("HOME"), &val[6]);
-
-	  img = mb_kbd_image_new (state->keyboard, buf);
-	}
-      else
-	img = mb_kbd_image_new (state->keyboard, &val[6]);
-
-      if (!img)
-	{
-	  fprintf(stderr, "matchbox-keyboard: Failed to load '%s'\n", &val[6]);
-	  state->error = True;
-	  return;
-	}
-      mb_kbd_key_set_image_face(state->current_key, keystate, img);
-    }
+    mb_kbd_config_cache_append (state->cache, MBKeyboardConfigOpImageFace,
+				keystate, 0, 0, &val[6]);
   else
-    {
-      mb_kbd_key_set_glyph_face(state->current_key, keystate, 
-				attr_get_val("display", attr));
-    }
+    mb_kbd_config_cache_append (state->cache, MBKeyboardConfigOpGlyphFace,
+				keystate, 0, 0, val);
 
   if ((val = attr_get_val("action", attr)) != NULL)
     {
@@ -419,6 +210,7 @@ config_handle_key_subtag(MBKeyboardConfigState *state,
 	     action="utf8char"     // optional, action defulats to this    
 	     action="modifier:Shift|Alt|ctrl|mod1|mod2|mod3|caps|layout"
 	     action="xkeysym:XK_BLAH"
+	     action="string:Some text"
 	     action="control:">    // return etc - not needed use lookup 
       */
 
@@ -432,9 +224,9 @@ config_handle_key_subtag(MBKeyboardConfigState *state,
 
 	  if (found_type)
 	    {
-	      mb_kbd_key_set_modifer_action(state->current_key,
-					    keystate,
-					    found_type);
+	      mb_kbd_config_cache_append (state->cache, 
+					  MBKeyboardConfigOpModifierAction,
+					  keystate, 0, found_type, NULL);
 	    }
 	  else
 	    {
@@ -447,13 +239,13 @@ config_handle_key_subtag(MBKeyboardConfigState *state,
 	{
 	  DBG("Checking %s\n", &val[8]);
 
-	  found_keysym = XStringToKeysym(&val[8]);
+	  found_keysym = config_xkeysym(&val[8]);
 
 	  if (found_keysym)
 	    {
-	      mb_kbd_key_set_keysym_action(state->current_key, 
-					   keystate,
-					   found_keysym);
+	      mb_kbd_config_cache_append (state->cache, 
+					  MBKeyboardConfigOpKeysymAction,
+					  keystate, 0, found_keysym, NULL);
 	    }
 	  else 
 	    {
@@ -462,6 +254,18 @@ config_handle_key_subtag(MBKeyboardConfigState *state,
 	      return;
 	    }
 	}
+      else if (!strncmp(val, "string:", 7))
+	{
+	  if (val[7] == '\0')
+	    {
+              set_error(state, "Empty string action");
+	      return;
+	    }
+
+	  mb_kbd_config_cache_append (state->cache, 
+				      MBKeyboardConfigOpStringAction,
+				      keystate, 0, 0, &val[7]);
+	}
       else
 	{
 	  /* Its just 'regular' key  */
@@ -469,15 +273,16 @@ config_handle_key_subtag(MBKeyboardConfigState *state,
 	  if (strlen(val) > 1  	/* match backspace, return etc */
 	      && ((found_keysym  = config_str_to_keysym(val)) != 0))
 	    {
-	      mb_kbd_key_set_keysym_action(state->current_key, 
-					   keystate,
-					   found_keysym);
+	      mb_kbd_config_cache_append (state->cache, 
+					  MBKeyboardConfigOpKeysymAction,
+					  keystate, 0, found_keysym, NULL);
 	    }
 	  else
 	    {
 	      /* XXX We should actually check its a single UTF8 Char here */
-	      mb_kbd_key_set_char_action(state->current_key, 
-					 keystate, val);
+	      mb_kbd_config_cache_append (state->cache, 
+					  MBKeyboardConfigOpCharAction,
+					  keystate, 0, 0, val);
 	    }
 	}
     }
@@ -488,9 +293,8 @@ config_handle_key_subtag(MBKeyboardConfigState *state,
        * or summin.
       */
 
-      mb_kbd_key_set_char_action(state->current_key, 
-				 keystate, 
-				 attr_get_val("display", attr));
+      mb_kbd_config_cache_append (state->cache, MBKeyboardConfigOpCharAction,
+				  keystate, 0, 0, attr_get_val("display", attr));
     }
 
 }
@@ -506,119 +310,136 @@ config_handle_layout_tag(MBKeyboardConfigState *state, const char **attr)
       return;
     }
 
-  state->current_layout = mb_kbd_layout_new(state->keyboard, val);
+  state->in_layout = True;
+  state->in_row    = False;
+  state->in_key    = False;
 
-  mb_kbd_add_layout(state->keyboard, state->current_layout);
+  mb_kbd_config_cache_append (state->cache, MBKeyboardConfigOpLayout,
+			      0, 0, 0, val);
 }
 
 static void
 config_handle_row_tag(MBKeyboardConfigState *state, const char **attr)
 {
-  state->current_row = mb_kbd_row_new(state->keyboard);
-  mb_kbd_layout_append_row(state->current_layout, state->current_row);
+  if (!state->in_layout)
+    {
+      set_error(state, "Row outside of a layout");
+      return;
+    }
+
+  state->in_row = True;
+  state->in_key = False;
+
+  mb_kbd_config_cache_append (state->cache, MBKeyboardConfigOpRow,
+			      0, 0, 0, NULL);
 }
 
 static void
-config_handle_key_tag(MBKeyboardConfigState *state, const char **attr)
+config_handle_key_tag(MBKeyboardConfigState *state, 
+		      const char           **attr, 
+		      boolean                blank)
 {
   const char *val;
+  int         flags = 0, width = 0;
   DBG("got key");
 
-  state->current_key = mb_kbd_key_new(state->keyboard);
+  if (!state->in_row)
+    {
+      set_error(state, "Key outside of a row");
+      return;
+    }
+
+  state->in_key = True;
 
   if ((val = attr_get_val("obey-caps", attr)) != NULL)
     {
       if (strcaseeq(val, "true"))
-	mb_kbd_key_set_obey_caps(state->current_key, True);
+	flags |= MBKeyboardConfigKeyObeyCaps;
     }
 
   if ((val = attr_get_val("extended", attr)) != NULL)
     {
       if (strcaseeq(val, "true"))
-	mb_kbd_key_set_extended(state->current_key, True);
+	flags |= MBKeyboardConfigKeyExtended;
     }
 
   if ((val = attr_get_val("width", attr)) != NULL)
     {
       if (atoi(val) > 0)
-	mb_kbd_key_set_req_uwidth(state->current_key, atoi(val));
+	width = atoi(val);
     }
 
   if ((val = attr_get_val("fill", attr)) != NULL)
     {
       if (strcaseeq(val, "true"))
-	mb_kbd_key_set_fill(state->current_key, True);
+	flags |= MBKeyboardConfigKeyFill;
     }
 
-  mb_kbd_row_append_key(state->current_row, state->current_key);
+  if (blank)
+    flags |= MBKeyboardConfigKeyBlank;
+
+  mb_kbd_config_cache_append (state->cache, MBKeyboardConfigOpKey,
+			      0, flags, width, NULL);
 }
 
 static void 
 config_xml_start_cb(void *data, const char *tag, const char **attr)
 {
   MBKeyboardConfigState *state = (MBKeyboardConfigState *)data;
+  unsigned int           found_tag;
+
+  if (!config_lookup(&MBKeyboardConfigTags, tag, &found_tag))
+    return;
 
-  if (streq(tag, "layout"))
+  switch (found_tag)
     {
+    case MBKeyboardConfigTagLayout:
       config_handle_layout_tag(state, attr);
-    }
-  else if (streq(tag, "row"))
-    {
+      break;
+    case MBKeyboardConfigTagRow:
       config_handle_row_tag(state, attr);
-    }
-  else if (streq(tag, "key"))
-    {
-      config_handle_key_tag(state, attr);
-    }
-  else  if (streq(tag, "space"))
-    {
-      config_handle_key_tag(state, attr);
-      mb_kbd_key_set_blank(state->current_key, True);
-    }
-  else if (streq(tag, "normal") 
-	   || streq(tag, "default")
-	   || streq(tag, "shifted")
-	   || streq(tag, "mod1")
-	   || streq(tag, "mod2")
-	   || streq(tag, "mod3"))
-    {
+      break;
+    case MBKeyboardConfigTagKey:
+      config_handle_key_tag(state, attr, False);
+      break;
+    case MBKeyboardConfigTagSpace:
+      config_handle_key_tag(state, attr, True);
+      break;
+    case MBKeyboardConfigTagState:
       config_handle_key_subtag(state, tag, attr);
+      break;
     }
 
   if (state->error)
     {
-      fprintf(stderr, "matchbox-keyboard:%s:%d: %s\n", state->keyboard->config_file, 
+      fprintf(stderr, "matchbox-keyboard:%s:%d: %s\n", state->path, 
                                               state->error_lineno, state->error_msg);
-      util_fatal_error("Error parsing\n");
+      XML_StopParser(state->parser, False);
     }
 }
 
 
-int
-mb_kbd_config_load(MBKeyboard *kbd, char *variant)
+/*
+ * Parses data, the contents of path, into the list of what to build.
+ * Returns NULL on any error, having said what it was.
+*/
+MBKeyboardConfigCache*
+mb_kbd_config_parse(const char *path, const char *data)
 {
-  char                  *data;
   XML_Parser             p;
   MBKeyboardConfigState *state;
-
-  if ((data = config_load_file(kbd, variant)) == NULL)
-    util_fatal_error("Couldn't find a keyboard config file\n");
+  MBKeyboardConfigCache *cache;
 
   p = XML_ParserCreate(NULL);
 
   if (!p) 
     util_fatal_error("Couldn't allocate memory for XML parser\n");
 
-  if (variant && !strstr(kbd->config_file, variant))
-    fprintf(stderr, 
-	    "matchbox-keyboard: *Warning* Unable to locate variant: %s\n"
-	    "                   falling back to %s\n",
-	    variant, kbd->config_file);
-
   state = util_malloc0(sizeof(MBKeyboardConfigState));
 
-  state->keyboard = kbd;
+  state->path = path;
   state->parser = p;
+  state->cache = mb_kbd_config_cache_new();
 
   XML_SetElementHandler(p, config_xml_start_cb, NULL);
 
@@ -626,15 +447,25 @@ mb_kbd_config_load(MBKeyboard *kbd, char *variant)
 
   XML_SetUserData(p, (void *)state);
 
-  if (! XML_Parse(p, data, strlen(data), 1)) {
+  if (! XML_Parse(p, data, strlen(data), 1) && !state->error) {
     fprintf(stderr, 
 	    "matchbox-keyboard:%s:%d: XML Parse error:%s\n",
-	    kbd->config_file,
+	    path,
 	    XML_GetCurrentLineNumber(p),
 	    XML_ErrorString(XML_GetErrorCode(p)));
-    util_fatal_error("XML Parse failed.\n");
+    state->error = True;
   }
 
-  return 1;
-}
+  cache = state->cache;
 
+  if (state->error)
+    {
+      mb_kbd_config_cache_free(cache);
+      cache = NULL;
+    }
+
+  XML_ParserFree(p);
+  free(state);
+
+  return cache;
+}
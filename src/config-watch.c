@@ -0,0 +1,243 @@
+/*
+ *  Matchbox Keyboard - A lightweight software keyboard.
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2, or (at your option)
+ *  any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ */
+
+/*
+ * Layout hot reload. The directories holding the config file and the
+ * images it uses are watched with inotify from the main loop ( see
+ * get_xevent_timed() ) and once any of those files has been rewritten
+ * mb_kbd_config_reload() rebuilds just what changed, no restart needed
+ * to see an edit.
+ *
+ * Directories rather than the files themselves, as plenty of editors
+ * save by writing a new file and renaming it over the old one.
+ */
+
+#include "matchbox-keyboard.h"
+
+#if HAVE_SYS_INOTIFY_H
+
+#include <sys/inotify.h>
+
+#define CONFIG_WATCH_MAX_DIRS 8
+
+struct MBKeyboardConfigWatch
+{
+  int      fd;
+  int      wds[CONFIG_WATCH_MAX_DIRS];
+  char    *dirs[CONFIG_WATCH_MAX_DIRS];
+  int      n_dirs;
+
+  int      config_wd;
+  char    *config_name;
+
+  /* Changed, waiting on nothing being held */
+  boolean  config_changed;
+  List    *images_changed;
+};
+
+/* Watches the directory path is in, returning its watch descriptor */
+static int
+config_watch_dir_of (MBKeyboardConfigWatch *watch, const char *path)
+{
+  const char *slash;
+  char       *dir;
+  int         i, wd;
+
+  if ((slash = strrchr(path, '/')) == NULL)
+    dir = strdup(".");
+  else if (slash == path)
+    dir = strdup("/");
+  else
+    dir = strndup(path, slash - path);
+
+  for (i = 0; i < watch->n_dirs; i++)
+    if (streq(watch->dirs[i], dir))
+      {
+	free(dir);
+	return watch->wds[i];
+      }
+
+  if (watch->n_dirs == CONFIG_WATCH_MAX_DIRS
+      || (wd = inotify_add_watch(watch->fd, dir,
+				 IN_CLOSE_WRITE|IN_MOVED_TO)) < 0)
+    {
+      DBG("not watching %s", dir);
+      free(dir);
+      return -1;
+    }
+
+  DBG("watching %s", dir);
+
+  watch->wds[watch->n_dirs]  = wd;
+  watch->dirs[watch->n_dirs] = dir;
+  watch->n_dirs++;
+
+  return wd;
+}
+
+MBKeyboardConfigWatch*
+mb_kbd_config_watch_new (const char *config_file)
+{
+  MBKeyboardConfigWatch *watch;
+  const char            *name;
+
+  watch = util_malloc0(sizeof(MBKeyboardConfigWatch));
+
+  if ((watch->fd = inotify_init1(IN_NONBLOCK|IN_CLOEXEC)) < 0)
+    {
+      DBG("inotify unavailable, layouts wont be reloaded");
+      free(watch);
+      return NULL;
+    }
+
+  name = strrchr(config_file, '/');
+
+  watch->config_name = strdup(name ? name + 1 : config_file);
+  watch->config_wd   = config_watch_dir_of (watch, config_file);
+
+  return watch;
+}
+
+/* Also reload whenever path, an image in use, changes */
+void
+mb_kbd_config_watch_add (MBKeyboardConfigWatch *watch, const char *path)
+{
+  if (watch)
+    config_watch_dir_of (watch, path);
+}
+
+int
+mb_kbd_config_watch_fd (MBKeyboardConfigWatch *watch)
+{
+  return watch ? watch->fd : -1;
+}
+
+static const char*
+config_watch_dir (MBKeyboardConfigWatch *watch, int wd)
+{
+  int i;
+
+  for (i = 0; i < watch->n_dirs; i++)
+    if (watch->wds[i] == wd)
+      return watch->dirs[i];
+
+  return NULL;
+}
+
+static void
+config_watch_image_changed (MBKeyboardConfigWatch *watch, const char *path)
+{
+  List *item;
+
+  for (item = util_list_get_first(watch->images_changed); item; item = item->next)
+    if (streq(item->data, path))
+      return;
+
+  watch->images_changed = util_list_append(watch->images_changed,
+					   strdup(path));
+}
+
+/* The watch fd is readable */
+void
+mb_kbd_config_watch_dispatch (MBKeyboard *kbd)
+{
+  MBKeyboardConfigWatch *watch = kbd->config_watch;
+  char                   buf[4096]
+                           __attribute__((aligned(__alignof__(struct inotify_event))));
+  char                   path[1024];
+  char                  *p;
+  ssize_t                len;
+
+  if (watch == NULL)
+    return;
+
+  while ((len = read(watch->fd, buf, sizeof(buf))) > 0)
+    for (p = buf; p < buf + len; )
+      {
+	const struct inotify_event *ev = (const struct inotify_event *)p;
+	const char                 *dir;
+
+	p += sizeof(struct inotify_event) + ev->len;
+
+	if (ev->len == 0 || (dir = config_watch_dir (watch, ev->wd)) == NULL)
+	  continue;
+
+	if (ev->wd == watch->config_wd && streq(ev->name, watch->config_name))
+	  {
+	    watch->config_changed = True;
+	    continue;
+	  }
+
+	/* Whether its actually in use is up to the reload */
+	snprintf(path, sizeof(path), "%s/%s", dir, ev->name);
+	config_watch_image_changed (watch, path);
+      }
+
+  mb_kbd_config_watch_idle (kbd);
+}
+
+/* Reloads anything changed, unless a key is held as it may be replaced */
+void
+mb_kbd_config_watch_idle (MBKeyboard *kbd)
+{
+  MBKeyboardConfigWatch *watch = kbd->config_watch;
+  List                  *item;
+
+  if (watch == NULL
+      || (!watch->config_changed && watch->images_changed == NULL)
+      || mb_kbd_get_held_key(kbd) != NULL)
+    return;
+
+  mb_kbd_config_reload (kbd, watch->config_changed, watch->images_changed);
+
+  for (item = util_list_get_first(watch->images_changed); item; item = item->next)
+    free(item->data);
+
+  util_list_free(watch->images_changed);
+
+  watch->images_changed = NULL;
+  watch->config_changed = False;
+}
+
+#else
+
+MBKeyboardConfigWatch*
+mb_kbd_config_watch_new (const char *config_file)
+{
+  return NULL;
+}
+
+void
+mb_kbd_config_watch_add (MBKeyboardConfigWatch *watch, const char *path)
+{
+}
+
+int
+mb_kbd_config_watch_fd (MBKeyboardConfigWatch *watch)
+{
+  return -1;
+}
+
+void
+mb_kbd_config_watch_dispatch (MBKeyboard *kbd)
+{
+}
+
+void
+mb_kbd_config_watch_idle (MBKeyboard *kbd)
+{
+}
+
+#endif
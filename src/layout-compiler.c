@@ -0,0 +1,156 @@
+/*
+ *  Matchbox Keyboard - A lightweight software keyboard.
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2, or (at your option)
+ *  any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ */
+
+/*
+ * Build time layout compiler. Parses each layout XML given and writes C
+ * for the ops it results in as static, read only data, along with the
+ * MBKeyboardConfigBuiltins table config-loader.c looks them up in by
+ * file name.
+ *
+ *   matchbox-keyboard-layout-compiler keyboard.xml ... > layouts-builtin.c
+ */
+
+#include "matchbox-keyboard.h"
+
+static char*
+compiler_read_file (const char *path)
+{
+  struct stat  st;
+  FILE        *fp;
+  char        *data;
+
+  if (stat(path, &st) || (fp = fopen(path, "rb")) == NULL)
+    {
+      fprintf(stderr, "layout-compiler: unable to open %s\n", path);
+      exit(1);
+    }
+
+  data = util_malloc0(st.st_size + 1);
+
+  if (fread(data, 1, st.st_size, fp) != st.st_size)
+    {
+      fprintf(stderr, "layout-compiler: unable to read %s\n", path);
+      exit(1);
+    }
+
+  fclose(fp);
+
+  return data;
+}
+
+static void
+compiler_write_strings (FILE *fp, const char *strings, unsigned int size)
+{
+  unsigned int i, col = 0;
+
+  fprintf(fp, "  \"");
+
+  for (i = 0; i < size; i++)
+    {
+      unsigned char c = strings[i];
+
+      /* Always 3 digit octal, so a following digit cant join in */
+      if (c < 0x20 || c >= 0x7f || c == '"' || c == '\\' || c == '?')
+	col += fprintf(fp, "\\%03o", c);
+      else
+	col += fprintf(fp, "%c", c);
+
+      if (col >= 64 && i + 1 < size)
+	{
+	  fprintf(fp, "\"\n  \"");
+	  col = 0;
+	}
+    }
+
+  fprintf(fp, "\"");
+}
+
+static void
+compiler_write_layout (FILE                *fp,
+		       int                  index,
+		       MBKeyboardConfigOps *ops)
+{
+  int i;
+
+  fprintf(fp, "static const MBKeyboardConfigOp Ops%i[] =\n  {\n", index);
+
+  for (i = 0; i < ops->n_ops; i++)
+    fprintf(fp, "    { %u, %u, 0x%x, 0x%x, %u },\n",
+	    ops->ops[i].type, ops->ops[i].state, ops->ops[i].flags,
+	    ops->ops[i].value, ops->ops[i].str);
+
+  if (ops->n_ops == 0)
+    fprintf(fp, "    { 0 }\n");
+
+  fprintf(fp, "  };\n\n");
+
+  /* Sized explicitly as the table ends in a NUL of its own */
+  fprintf(fp, "static const char Strings%i[%u] =\n", index, ops->strings_size);
+  compiler_write_strings (fp, ops->strings, ops->strings_size);
+  fprintf(fp, ";\n\n");
+}
+
+int
+main(int argc, char **argv)
+{
+  MBKeyboardConfigOps *layouts;
+  int                  i;
+
+  if (argc < 2)
+    {
+      fprintf(stderr, "usage: %s <layout xml> ...\n", argv[0]);
+      return 1;
+    }
+
+  layouts = util_malloc0(sizeof(MBKeyboardConfigOps) * argc);
+
+  printf("/* Generated by matchbox-keyboard-layout-compiler, do not edit */\n\n"
+	 "#include \"matchbox-keyboard.h\"\n\n");
+
+  for (i = 1; i < argc; i++)
+    {
+      MBKeyboardConfigCache *cache;
+      char                  *data;
+
+      data  = compiler_read_file (argv[i]);
+      if ((cache = mb_kbd_config_parse (argv[i], data)) == NULL)
+	exit(1);
+
+      mb_kbd_config_cache_get_ops (cache, &layouts[i]);
+      compiler_write_layout (stdout, i, &layouts[i]);
+
+      /* Only the counts are used from here on */
+      mb_kbd_config_cache_free (cache);
+      free(data);
+    }
+
+  printf("const MBKeyboardConfigBuiltin MBKeyboardConfigBuiltins[] =\n  {\n");
+
+  for (i = 1; i < argc; i++)
+    {
+      const char *name = strrchr(argv[i], '/');
+
+      printf("    { \"%s\", { Ops%i, %i, Strings%i, %u } },\n",
+	     name ? name + 1 : argv[i], 
+	     i, layouts[i].n_ops, i, layouts[i].strings_size);
+    }
+
+  printf("    { NULL }\n  };\n");
+
+  if (fflush(stdout) != 0 || ferror(stdout))
+    return 1;
+
+  return 0;
+}
@@ -0,0 +1,409 @@
+/*
+ *  Matchbox Keyboard - A lightweight software keyboard.
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2, or (at your option)
+ *  any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ */
+
+/*
+ * Injection benchmark, see 'make bench-inject'. Types each corpus file
+ * given through the injector, the same way key presses from the UI get
+ * there, into a window of our own on a second connection. Every
+ * KeyPress the window gets is matched back to the character sent to
+ * give chars/sec, send to receive latency and any characters lost,
+ * reordered or turned into something else along the way.
+ *
+ * Wants a display to itself ( it takes the focus ), Xvfb is fine.
+ */
+
+#include "matchbox-keyboard.h"
+#include "matchbox-keyboard-remote.h"
+#include <X11/XKBlib.h>
+
+/* Characters allowed in flight before waiting on the receiver. Well
+ * under the injection queue size, which takes two entries a character.
+*/
+#define BENCH_WINDOW      32
+#define BENCH_TIMEOUT_MS  2000
+
+/* Stand ins for the bits of the UI the injector asks for */
+struct MBKeyboardUI
+{
+  Display *xdpy;
+  Atom     commit_atom;
+};
+
+Display*
+mb_kbd_ui_x_display(MBKeyboardUI *ui)
+{
+  return ui->xdpy;
+}
+
+Atom
+mb_kbd_ui_x_atom(MBKeyboardUI *ui, MBKeyboardAtomType atom)
+{
+  return ui->commit_atom;
+}
+
+typedef struct BenchCorpus
+{
+  const char    *path;
+  KeySym        *keysyms;
+  long long     *sent_at;
+  unsigned char *matched;
+  int            n;
+}
+BenchCorpus;
+
+typedef struct BenchResult
+{
+  int        received, matched, lost, reordered, wrong;
+  long long  usecs;
+  long long *latencies;
+}
+BenchResult;
+
+static boolean
+bench_load_corpus (BenchCorpus *corpus, const char *path)
+{
+  FILE         *fp;
+  char         *buf, *p;
+  long          size;
+  unsigned int  ucs4;
+  int           len;
+
+  if ((fp = fopen(path, "r")) == NULL)
+    {
+      fprintf(stderr, "bench-inject: unable to open %s\n", path);
+      return False;
+    }
+
+  fseek(fp, 0, SEEK_END);
+  size = ftell(fp);
+  rewind(fp);
+
+  buf = util_malloc0(size + 1);
+
+  if (fread(buf, 1, size, fp) != (size_t)size)
+    {
+      fprintf(stderr, "bench-inject: unable to read %s\n", path);
+      fclose(fp);
+      free(buf);
+      return False;
+    }
+
+  fclose(fp);
+
+  corpus->path    = path;
+  corpus->keysyms = util_malloc0(sizeof(KeySym) * (size + 1));
+  corpus->n       = 0;
+
+  for (p = buf; *p != '\0'; p += len)
+    {
+      if ((len = util_utf8_get_char(p, &ucs4)) < 0)
+	{
+	  fprintf(stderr, "bench-inject: %s is not valid UTF-8\n", path);
+	  free(buf);
+	  return False;
+	}
+
+      /* As the injector does it, so what arrives compares directly. Line
+       * breaks and tabs get typed too, as Return and Tab.
+      */
+      if ((corpus->keysyms[corpus->n] = mb_kbd_inject_ucs4_to_keysym(ucs4)) 
+	  != NoSymbol)
+	corpus->n++;
+    }
+
+  free(buf);
+
+  corpus->sent_at = util_malloc0(sizeof(long long) * (corpus->n + 1));
+  corpus->matched = util_malloc0(corpus->n + 1);
+
+  return True;
+}
+
+static Window
+bench_receiver_new (Display *xdpy)
+{
+  XEvent ev;
+  Window win;
+
+  win = XCreateSimpleWindow(xdpy, DefaultRootWindow(xdpy),
+			    0, 0, 100, 100, 0,
+			    BlackPixel(xdpy, DefaultScreen(xdpy)),
+			    WhitePixel(xdpy, DefaultScreen(xdpy)));
+
+  XSelectInput(xdpy, win, KeyPressMask|StructureNotifyMask);
+  XMapWindow(xdpy, win);
+
+  do
+    XWindowEvent(xdpy, win, StructureNotifyMask, &ev);
+  while (ev.type != MapNotify);
+
+  XSetInputFocus(xdpy, win, RevertToPointerRoot, CurrentTime);
+  XSync(xdpy, False);
+
+  return win;
+}
+
+/*
+ * Matches a received keysym to the first character sent with it that
+ * hasn't arrived yet. Arriving before something sent earlier that is
+ * still outstanding makes it reordered, anything never matched by the
+ * end was lost.
+*/
+static void
+bench_receive (BenchCorpus *corpus,
+	       BenchResult *res,
+	       KeySym       ks,
+	       int          n_sent,
+	       int         *cursor,
+	       int         *highest)
+{
+  unsigned int ucs4;
+  int          i;
+
+  res->received++;
+
+  /* A map binding a legacy keysym, eg Cyrillic_a, types the same char */
+  if ((ucs4 = mb_kbd_inject_keysym_to_ucs4 (ks)) != 0)
+    ks = mb_kbd_inject_ucs4_to_keysym (ucs4);
+
+  for (i = *cursor; i < n_sent; i++)
+    if (!corpus->matched[i] && corpus->keysyms[i] == ks)
+      break;
+
+  if (i == n_sent)
+    {
+      res->wrong++;
+      return;
+    }
+
+  corpus->matched[i] = 1;
+  res->latencies[res->matched++] = util_monotonic_usec() - corpus->sent_at[i];
+
+  if (i < *highest)
+    res->reordered++;
+  else
+    *highest = i;
+
+  while (*cursor < n_sent && corpus->matched[*cursor])
+    (*cursor)++;
+}
+
+static int
+bench_process_xevents (Display     *xdpy,
+		       BenchCorpus *corpus,
+		       BenchResult *res,
+		       int          n_sent,
+		       int         *cursor,
+		       int         *highest)
+{
+  int n = 0;
+
+  while (XPending(xdpy))
+    {
+      XEvent       ev;
+      KeySym       ks;
+      unsigned int mods;
+
+      XNextEvent(xdpy, &ev);
+
+      switch (ev.type)
+	{
+	case MappingNotify:
+	  XRefreshKeyboardMapping(&ev.xmapping);
+	  break;
+	case KeyPress:
+	  /* Takes care of any group and modifiers latched for the key */
+	  if (!XkbLookupKeySym(xdpy, ev.xkey.keycode, ev.xkey.state,
+			       &mods, &ks))
+	    ks = NoSymbol;
+
+	  bench_receive (corpus, res, ks, n_sent, cursor, highest);
+	  n++;
+	  break;
+	default:
+	  break;
+	}
+    }
+
+  return n;
+}
+
+static int
+bench_wait (Display *xdpy, int timeout_ms)
+{
+  struct timeval tv;
+  fd_set         fds;
+  int            fd = ConnectionNumber(xdpy);
+
+  if (XPending(xdpy))
+    return 1;
+
+  FD_ZERO(&fds);
+  FD_SET(fd, &fds);
+
+  tv.tv_sec  = timeout_ms / 1000;
+  tv.tv_usec = (timeout_ms % 1000) * 1000;
+
+  return select(fd + 1, &fds, NULL, NULL, &tv);
+}
+
+static int
+bench_cmp_usec (const void *a, const void *b)
+{
+  long long x = *(const long long *)a, y = *(const long long *)b;
+
+  return (x > y) - (x < y);
+}
+
+static void
+bench_run (MBKeyboardInjector *inj,
+	   Display            *xdpy,
+	   BenchCorpus        *corpus,
+	   BenchResult        *res)
+{
+  long long start;
+  int       n_sent = 0, written_off = 0, cursor = 0, highest = 0, i;
+
+  memset(res, 0, sizeof(BenchResult));
+  res->latencies = util_malloc0(sizeof(long long) * (corpus->n + 1));
+
+  start = util_monotonic_usec();
+
+  while (cursor < corpus->n)
+    {
+      /* Keep the window full, counting what has arrived whether it
+       * matched or not so nothing lost can stall us.
+      */
+      while (n_sent < corpus->n
+	     && n_sent - res->received - written_off < BENCH_WINDOW)
+	{
+	  corpus->sent_at[n_sent] = util_monotonic_usec();
+	  mb_kbd_inject_press_keysym (inj, corpus->keysyms[n_sent], 0);
+	  mb_kbd_inject_release (inj);
+	  n_sent++;
+	}
+
+      if (bench_wait (xdpy, BENCH_TIMEOUT_MS) <= 0)
+	{
+	  /* Nothing more is coming for what is in flight */
+	  if (n_sent == corpus->n)
+	    break;
+
+	  written_off = n_sent - res->received;
+	  continue;
+	}
+
+      bench_process_xevents (xdpy, corpus, res, n_sent, &cursor, &highest);
+    }
+
+  res->usecs = util_monotonic_usec() - start;
+
+  for (i = 0; i < corpus->n; i++)
+    if (!corpus->matched[i])
+      res->lost++;
+
+  qsort(res->latencies, res->matched, sizeof(long long), bench_cmp_usec);
+}
+
+static long long
+bench_percentile (BenchResult *res, int percent)
+{
+  if (res->matched == 0)
+    return 0;
+
+  return res->latencies[(res->matched * percent + 99) / 100 - 1];
+}
+
+static void
+bench_report (BenchCorpus *corpus, BenchResult *res)
+{
+  const char *name;
+
+  if ((name = strrchr(corpus->path, '/')) != NULL)
+    name++;
+  else
+    name = corpus->path;
+
+  fprintf(stdout, "  %-16s %7i %10.0f %8lli %8lli %8lli %6i %6i %6i\n",
+	  name,
+	  corpus->n,
+	  res->usecs ? res->matched * 1000000.0 / res->usecs : 0.0,
+	  bench_percentile(res, 50),
+	  bench_percentile(res, 99),
+	  res->matched ? res->latencies[res->matched - 1] : 0,
+	  res->lost,
+	  res->reordered,
+	  res->wrong);
+}
+
+int
+main(int argc, char **argv)
+{
+  MBKeyboardUI        ui;
+  MBKeyboardInjector *inj;
+  Display            *xdpy;
+  int                 i, failed = 0;
+
+  if (argc < 2)
+    {
+      fprintf(stderr, "usage: %s <utf-8 corpus file> ...\n", argv[0]);
+      return 1;
+    }
+
+  /* The injector runs its own thread */
+  XInitThreads();
+
+  if ((xdpy = XOpenDisplay(getenv("DISPLAY"))) == NULL)
+    {
+      fprintf(stderr, "bench-inject: unable to open display\n");
+      return 1;
+    }
+
+  ui.xdpy        = xdpy;
+  ui.commit_atom = XInternAtom(xdpy, MB_KBD_REMOTE_COMMIT_ATOM, False);
+
+  if ((inj = mb_kbd_inject_new (&ui)) == NULL)
+    {
+      fprintf(stderr, "bench-inject: unable to set up injection\n");
+      return 1;
+    }
+
+  bench_receiver_new (xdpy);
+
+  fprintf(stdout, "bench-inject: %-16s %7s %10s %8s %8s %8s %6s %6s %6s\n",
+	  "", "chars", "chars/sec", "p50 us", "p99 us", "max us",
+	  "lost", "reord", "wrong");
+
+  for (i = 1; i < argc; i++)
+    {
+      BenchCorpus corpus;
+      BenchResult res;
+
+      if (!bench_load_corpus (&corpus, argv[i]))
+	return 1;
+
+      bench_run (inj, xdpy, &corpus, &res);
+      bench_report (&corpus, &res);
+
+      failed |= res.lost || res.reordered || res.wrong;
+
+      free(corpus.keysyms);
+      free(corpus.sent_at);
+      free(corpus.matched);
+      free(res.latencies);
+    }
+
+  return failed;
+}
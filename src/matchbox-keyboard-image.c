@@ -19,15 +19,43 @@
 
 #include "matchbox-keyboard.h"
 #include <X11/extensions/Xrender.h>
+#include <pthread.h>
+
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#elif defined(__ARM_NEON)
+#include <arm_neon.h>
+#endif
 
 struct MBKeyboardImage
 {
   MBKeyboard            *kbd;
+  char                  *path;
+  int                    refs;
   int                    width, height;
   Pixmap                 xdraw;
   Picture                xpic;
 };
 
+/*
+ * Every image loaded and not yet destroyed, by path. The same icons turn
+ * up across layouts and keys, this way each is decoded and uploaded to
+ * the server once.
+*/
+static List *ImageCache = NULL;
+
+static MBKeyboardImage*
+image_cache_lookup (const char *filename)
+{
+  List *item;
+
+  for (item = util_list_get_first(ImageCache); item; item = item->next)
+    if (streq(((MBKeyboardImage *)item->data)->path, filename))
+      return item->data;
+
+  return NULL;
+}
+
 static unsigned char* 
 png_file_load (const char *file, 
 	       int        *width, 
@@ -125,30 +153,122 @@ png_file_load (const char *file,
   return data;
 }
 
-MBKeyboardImage*
-mb_kbd_image_new (MBKeyboard *kbd, const char *filename)
+/*
+ * Premultiplies n RGBA pixels from png_file_load(), in place, into ARGB32
+ * as LSBFirst bytes ( B, G, R, A ) ready for a ZPixmap. Each channel
+ * becomes c * (a + 1) / 256, the SIMD paths just do it 4 or 16 at a time.
+*/
+static void
+image_premultiply (unsigned char *p, int n)
+{
+  int i = 0;
+
+#if defined(__SSE2__)
+  const __m128i zero  = _mm_setzero_si128();
+  const __m128i one   = _mm_set1_epi16(1);
+  const __m128i alpha = _mm_set_epi16(-1, 0, 0, 0, -1, 0, 0, 0);
+
+  for (; i + 4 <= n; i += 4)
+    {
+      __m128i px = _mm_loadu_si128((__m128i *)(p + i * 4));
+      __m128i lo = _mm_unpacklo_epi8(px, zero), hi = _mm_unpackhi_epi8(px, zero);
+      __m128i a_lo, a_hi;
+
+      /* Each pixel's alpha + 1 across its 4 lanes */
+      a_lo = _mm_shufflehi_epi16(_mm_shufflelo_epi16(lo, 0xff), 0xff);
+      a_hi = _mm_shufflehi_epi16(_mm_shufflelo_epi16(hi, 0xff), 0xff);
+
+      a_lo = _mm_srli_epi16(_mm_mullo_epi16(lo, _mm_add_epi16(a_lo, one)), 8);
+      a_hi = _mm_srli_epi16(_mm_mullo_epi16(hi, _mm_add_epi16(a_hi, one)), 8);
+
+      /* Alpha itself is kept as is */
+      lo = _mm_or_si128(_mm_and_si128(alpha, lo), _mm_andnot_si128(alpha, a_lo));
+      hi = _mm_or_si128(_mm_and_si128(alpha, hi), _mm_andnot_si128(alpha, a_hi));
+
+      /* R G B A -> B G R A */
+      lo = _mm_shufflehi_epi16(_mm_shufflelo_epi16(lo, 0xc6), 0xc6);
+      hi = _mm_shufflehi_epi16(_mm_shufflelo_epi16(hi, 0xc6), 0xc6);
+
+      _mm_storeu_si128((__m128i *)(p + i * 4), _mm_packus_epi16(lo, hi));
+    }
+#elif defined(__ARM_NEON)
+  for (; i + 16 <= n; i += 16)
+    {
+      uint8x16x4_t px = vld4q_u8(p + i * 4), out;
+      uint8x16_t   a  = px.val[3];
+      int          c;
+
+      for (c = 0; c < 3; c++)
+	{
+	  uint16x8_t lo, hi;
+
+	  lo = vaddw_u8(vmull_u8(vget_low_u8(px.val[c]), vget_low_u8(a)),
+			vget_low_u8(px.val[c]));
+	  hi = vaddw_u8(vmull_u8(vget_high_u8(px.val[c]), vget_high_u8(a)),
+			vget_high_u8(px.val[c]));
+
+	  out.val[2 - c] = vcombine_u8(vshrn_n_u16(lo, 8), vshrn_n_u16(hi, 8));
+	}
+
+      out.val[3] = a;
+      vst4q_u8(p + i * 4, out);
+    }
+#endif
+
+  for (; i < n; i++)
+    {
+      unsigned char *q = p + i * 4, r = q[0], g = q[1], b = q[2], a = q[3];
+
+      q[0] = (b * (a + 1)) / 256;
+      q[1] = (g * (a + 1)) / 256;
+      q[2] = (r * (a + 1)) / 256;
+      q[3] = a;
+    }
+}
+
+/* Loads filename ready for image_upload(), safe off the main thread */
+static unsigned char*
+image_decode (const char *filename, int *width, int *height)
+{
+  unsigned char *data;
+
+  data = png_file_load (filename, width, height);
+
+  if (data == NULL || *width == 0 || *height == 0)
+    {
+      if (data) free(data);
+      return NULL;
+    }
+
+  image_premultiply (data, *width * *height);
+
+  return data;
+}
+
+/* Puts decoded data on the server as the image for filename, taking data */
+static MBKeyboardImage*
+image_upload (MBKeyboard    *kbd,
+	      const char    *filename,
+	      unsigned char *data,
+	      int            width,
+	      int            height)
 {
   MBKeyboardUI            *ui;
   MBKeyboardImage         *img;
-  unsigned char           *data, *p;
-  int                      width, height, x, y;
+  unsigned char           *p;
+  int                      i;
   XRenderPictFormat       *ren_fmt;
   XRenderPictureAttributes ren_attr;
   GC                       gc;
   XImage                  *ximg;
 
   ui = kbd->ui;
-  
-  data = png_file_load (filename, &width, &height);
-
-  if (data == NULL || width == 0 || height == 0)
-    {
-      if (data) free(data);
-      return NULL;
-    }
 
   img = util_malloc0(sizeof(MBKeyboardImage));
 
+  img->kbd    = kbd;
+  img->path   = strdup(filename);
+  img->refs   = 1;
   img->width  = width;
   img->height = height;
 
@@ -159,8 +279,6 @@ mb_kbd_image_new (MBKeyboard *kbd, const char *filename)
 			     width, height, 
 			     ren_fmt->depth);
 
-  XSync(mb_kbd_ui_x_display(ui), False);
-
   ren_attr.dither          = True;
   ren_attr.component_alpha = True;
   ren_attr.repeat          = False;
@@ -173,31 +291,26 @@ mb_kbd_image_new (MBKeyboard *kbd, const char *filename)
 
   gc = XCreateGC(mb_kbd_ui_x_display(ui), img->xdraw, 0, NULL);
 
+  /* The decoded rows are packed 32bpp already, so are the image data */
   ximg = XCreateImage(mb_kbd_ui_x_display(ui), 
 		      DefaultVisual(mb_kbd_ui_x_display(ui), 
 				    mb_kbd_ui_x_screen(ui)), 
 		      ren_fmt->depth, 
 		      ZPixmap, 
 		      0, 
-		      NULL, 
+		      (char *)data, 
 		      width, 
 		      height, 
 		      32, 
-		      0);
-  
-  ximg->data = malloc(ximg->bytes_per_line * ximg->height);
-
-  p = data;
+		      width * 4);
 
-  for (y = 0; y < height; y++)
-    for (x = 0; x < width; x++)
+  if (ximg->byte_order == MSBFirst)
+    for (i = 0, p = data; i < width * height; i++, p += 4)
       {
-	unsigned char a, r, g, b;
-	r = *p++; g = *p++; b = *p++; a = *p++; 
-	r = (r * (a + 1)) / 256; /* premult */
-	g = (g * (a + 1)) / 256;
-	b = (b * (a + 1)) / 256;
-	XPutPixel(ximg, x, y, (a << 24) | (r << 16) | (g << 8) | b);
+	unsigned char t;
+
+	t = p[0]; p[0] = p[3]; p[3] = t;
+	t = p[1]; p[1] = p[2]; p[2] = t;
       }
 
   XPutImage(mb_kbd_ui_x_display(ui), 
@@ -206,16 +319,186 @@ mb_kbd_image_new (MBKeyboard *kbd, const char *filename)
 	    ximg, 
 	    0, 0, 0, 0, width, height);
 
-  free(ximg->data);
-  ximg->data = NULL;
-  XDestroyImage(ximg);
+  XDestroyImage(ximg);		/* frees data too */
   XFreeGC (mb_kbd_ui_x_display(ui), gc);
 
-  free(data);
+  ImageCache = util_list_append(ImageCache, img);
 
   return img;
 }
 
+MBKeyboardImage*
+mb_kbd_image_new (MBKeyboard *kbd, const char *filename)
+{
+  MBKeyboardImage *img;
+  unsigned char   *data;
+  int              width, height;
+
+  if ((img = image_cache_lookup (filename)) != NULL)
+    {
+      img->refs++;
+      return img;
+    }
+
+  if ((data = image_decode (filename, &width, &height)) == NULL)
+    return NULL;
+
+  return image_upload (kbd, filename, data, width, height);
+}
+
+/*
+ * Decoding for mb_kbd_image_preload(). Workers take the next path going
+ * and decode it, the main thread uploads each as soon as its done as only
+ * it may talk to the server.
+*/
+#define IMAGE_MAX_WORKERS 8
+
+typedef struct ImageDecodeJob
+{
+  const char    *path;
+  unsigned char *data;
+  int            width, height;
+  boolean        decoded, uploaded;
+}
+ImageDecodeJob;
+
+typedef struct ImageDecodePool
+{
+  ImageDecodeJob  *jobs;
+  int              n_jobs, next;
+  pthread_mutex_t  lock;
+  pthread_cond_t   decoded;
+}
+ImageDecodePool;
+
+static void*
+image_decode_worker (void *data)
+{
+  ImageDecodePool *pool = data;
+  ImageDecodeJob  *job;
+
+  for (;;)
+    {
+      pthread_mutex_lock(&pool->lock);
+      job = (pool->next < pool->n_jobs) ? &pool->jobs[pool->next++] : NULL;
+      pthread_mutex_unlock(&pool->lock);
+
+      if (job == NULL)
+	return NULL;
+
+      job->data = image_decode (job->path, &job->width, &job->height);
+
+      pthread_mutex_lock(&pool->lock);
+      job->decoded = True;
+      pthread_cond_signal(&pool->decoded);
+      pthread_mutex_unlock(&pool->lock);
+    }
+}
+
+/* Waits for a decoded job not yet uploaded, with pool locked */
+static ImageDecodeJob*
+image_decode_pool_wait (ImageDecodePool *pool)
+{
+  int i;
+
+  for (;;)
+    {
+      for (i = 0; i < pool->n_jobs; i++)
+	if (pool->jobs[i].decoded && !pool->jobs[i].uploaded)
+	  {
+	    pool->jobs[i].uploaded = True;
+	    return &pool->jobs[i];
+	  }
+
+      pthread_cond_wait(&pool->decoded, &pool->lock);
+    }
+}
+
+/*
+ * Loads all of paths up front, decoding them in parallel, so the
+ * mb_kbd_image_new() calls for them that follow are just lookups.
+ * Returns a reference to each image loaded, for the caller to destroy
+ * once done with them. Any that fail are left for mb_kbd_image_new() to
+ * fail on.
+*/
+List*
+mb_kbd_image_preload (MBKeyboard *kbd, List *paths)
+{
+  ImageDecodePool  pool;
+  pthread_t        workers[IMAGE_MAX_WORKERS];
+  MBKeyboardImage *img;
+  List            *images = NULL, *item;
+  int              n_workers, i;
+
+  if (paths == NULL)
+    return NULL;
+
+  memset(&pool, 0, sizeof(pool));
+  pool.jobs = util_malloc0(sizeof(ImageDecodeJob) * util_list_length(paths));
+
+  for (item = util_list_get_first(paths); item; item = item->next)
+    {
+      if ((img = image_cache_lookup (item->data)) != NULL)
+	{
+	  img->refs++;
+	  images = util_list_append(images, img);
+	  continue;
+	}
+
+      for (i = 0; i < pool.n_jobs; i++)
+	if (streq(pool.jobs[i].path, item->data))
+	  break;
+
+      if (i == pool.n_jobs)
+	pool.jobs[pool.n_jobs++].path = item->data;
+    }
+
+  pthread_mutex_init(&pool.lock, NULL);
+  pthread_cond_init(&pool.decoded, NULL);
+
+  n_workers = sysconf(_SC_NPROCESSORS_ONLN);
+
+  if (n_workers > IMAGE_MAX_WORKERS)
+    n_workers = IMAGE_MAX_WORKERS;
+  if (n_workers > pool.n_jobs)
+    n_workers = pool.n_jobs;
+
+  /* Not worth a thread for one, and the main thread uploads meanwhile */
+  for (i = 0; n_workers > 1 && i < n_workers; i++)
+    if (pthread_create(&workers[i], NULL, image_decode_worker, &pool) != 0)
+      break;
+
+  n_workers = (n_workers > 1) ? i : 0;
+
+  if (n_workers == 0)
+    image_decode_worker (&pool);
+
+  DBG("decoding %i images on %i threads", pool.n_jobs, n_workers);
+
+  for (i = 0; i < pool.n_jobs; i++)
+    {
+      ImageDecodeJob *job;
+
+      pthread_mutex_lock(&pool.lock);
+      job = image_decode_pool_wait (&pool);
+      pthread_mutex_unlock(&pool.lock);
+
+      if (job->data)
+	images = util_list_append(images,
+				  image_upload (kbd, job->path, job->data,
+						job->width, job->height));
+    }
+
+  for (i = 0; i < n_workers; i++)
+    pthread_join(workers[i], NULL);
+
+  pthread_cond_destroy(&pool.decoded);
+  pthread_mutex_destroy(&pool.lock);
+  free(pool.jobs);
+
+  return images;
+}
+
 int
 mb_kbd_image_width (MBKeyboardImage *img)
 {
@@ -237,7 +520,33 @@ mb_kbd_image_render_picture (MBKeyboardImage *img)
 void
 mb_kbd_image_destroy (MBKeyboardImage *img)
 {
-  /* ... */
+  Display *xdpy;
+
+  if (--img->refs > 0)
+    return;
+
+  xdpy = mb_kbd_ui_x_display(img->kbd->ui);
+
+  ImageCache = util_list_remove(ImageCache, img);
+
+  XRenderFreePicture(xdpy, img->xpic);
+  XFreePixmap(xdpy, img->xdraw);
+
+  free(img->path);
+  free(img);
+}
+
+/*
+ * filename has been rewritten, so the next new() for it loads it afresh.
+ * Anything still holding the old image keeps it until destroyed.
+*/
+void
+mb_kbd_image_invalidate (const char *filename)
+{
+  MBKeyboardImage *img;
+
+  if ((img = image_cache_lookup (filename)) != NULL)
+    ImageCache = util_list_remove(ImageCache, img);
 }
 
 
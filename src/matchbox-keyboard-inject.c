@@ -0,0 +1,1385 @@
+/*
+ *  Matchbox Keyboard - A lightweight software keyboard.
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2, or (at your option)
+ *  any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ */
+
+/*
+ * Key injection.
+ *
+ * Keysyms not in the keymap get bound to one of a pool of keycodes which
+ * had nothing on them at startup. The pool is kept in LRU order so a
+ * keysym already bound is simply pressed again; the keymap is only
+ * changed ( and every client on the display told to reload theirs ) when
+ * a keysym not seen recently turns up. libfakekey instead rebinds a spare
+ * keycode and uploads the whole keymap on every such press.
+ *
+ * All of this happens on a thread of its own, with its own X connection,
+ * fed in order from a single producer / single consumer queue. The UI
+ * thread only ever appends to the queue.
+ *
+ * With MB_KBD_INJECT=uinput the key events are written to a /dev/uinput
+ * virtual keyboard instead of going through XTest. The X keymap is still
+ * what keysyms are looked up in ( and the pool rebinds ), evdev codes
+ * being X keycodes less 8 as they are with the evdev X driver.
+ *
+ * Where the server has XKB, keysyms are resolved against every group
+ * and shift level of the XKB map ( so AltGr or second layout characters
+ * need no rebinding ) and reached by latching the group and modifiers
+ * for the one key press rather than pressing modifier keys. Keysyms are
+ * matched by character, so the 'Unicode' keysym typing gives finds the
+ * legacy one, eg Cyrillic_a, a map binds it as.
+ *
+ * Modifier keys that do get pressed are left down between keys that
+ * want them, only changing when what the next key needs differs, so a
+ * run of shifted or control keys costs one modifier press and release
+ * rather than one around each key. They are let go after a short idle,
+ * when the keyboard is hidden and at exit.
+ */
+
+#include "matchbox-keyboard.h"
+#include <X11/XKBlib.h>
+#include <X11/extensions/XTest.h>
+#include <errno.h>
+#include <poll.h>
+#include <pthread.h>
+
+#if HAVE_LINUX_UINPUT_H
+#include <sys/ioctl.h>
+#include <linux/uinput.h>
+
+#define INJECT_EVDEV_OFFSET 8
+#endif
+
+#define INJECT_POOL_MAX 64
+#define INJECT_SERIALS_MAX 32
+#define INJECT_QUEUE_SIZE 256 	/* must be a power of two */
+#define INJECT_MODS_IDLE_MS 300
+#define INJECT_UINPUT_SETTLE_US 5000
+
+typedef enum 
+{
+  MBKeyboardInjectXTest = 0,
+  MBKeyboardInjectUInput,
+}
+MBKeyboardInjectBackendType;
+
+typedef enum 
+{
+  MBKeyboardInjectPress = 0,
+  MBKeyboardInjectRelease,
+  MBKeyboardInjectString,
+  MBKeyboardInjectCommit,
+  MBKeyboardInjectReleaseModifiers,
+  MBKeyboardInjectQuit,
+}
+MBKeyboardInjectEventType;
+
+typedef struct MBKeyboardInjectEvent
+{
+  MBKeyboardInjectEventType type;
+  KeySym                    keysym;
+  int                       modifiers;
+  KeySym                   *keysyms; /* string, freed by the thread */
+  int                       n_keysyms;
+  char                     *utf8;    /* commit, freed by the thread */
+  Window                    window;
+}
+MBKeyboardInjectEvent;
+
+/* Where a keysym lives in the XKB map, and how to get at it */
+typedef struct MBKeyboardInjectResolved
+{
+  KeySym        keysym;   /* NoSymbol if empty slot */
+  KeyCode       keycode;
+  unsigned char group;
+  unsigned int  mods;
+}
+MBKeyboardInjectResolved;
+
+typedef struct MBKeyboardInjectPoolEntry
+{
+  KeyCode       keycode;
+  KeySym        keysym;   /* NoSymbol if free */
+  unsigned long used;     /* LRU stamp */
+  boolean       unsynced; /* pressed since the last inject_sync_keys() */
+}
+MBKeyboardInjectPoolEntry;
+
+struct MBKeyboardInjector
+{
+  /* UI thread only */
+  boolean                   dropped_press;
+
+  /* Shared, see inject_queue_push() */
+  MBKeyboardInjectEvent     queue[INJECT_QUEUE_SIZE];
+  unsigned int              head, tail;
+  int                       wake_fds[2];
+
+  /* Injection thread only from here on */
+  pthread_t                 thread;
+  Display                  *xdpy;
+  Atom                      commit_atom;
+  boolean                   keys_unsynced; /* XTest sent since last sync */
+
+  MBKeyboardInjectBackendType backend;
+#if HAVE_LINUX_UINPUT_H
+  int                       uinput_fd;
+  struct input_event       *events; /* batched till inject_flush() */
+  int                       n_events, events_alloc;
+  boolean                   remap_unsynced; /* pool bound, not synced */
+#endif
+
+  int                       min_keycode, max_keycode;
+  int                       keysyms_per_keycode;
+  KeySym                   *keysyms;
+
+  boolean                   have_xkb;
+  int                       xkb_event_base;
+  int                       locked_group;
+  MBKeyboardInjectResolved *resolved; /* open addressed, by character */
+  unsigned int              resolved_size;
+
+  MBKeyboardInjectPoolEntry pool[INJECT_POOL_MAX];
+  int                       n_pool;
+  unsigned long             clock;
+
+  /* Requests of our own that will come back as MappingNotify */
+  unsigned long             serials[INJECT_SERIALS_MAX];
+  int                       n_serials;
+
+  boolean                   reload_pending;
+
+  /* What the current press holds down, released in reverse */
+  KeyCode                   held_keycode;
+  int                       sent_mods;     /* FAKEKEYMOD_* held down */
+  KeyCode                   mod_keycodes[4];
+};
+
+static struct
+{
+  int    flag;
+  KeySym keysym;
+}
+ModifierKeysyms[] =
+  {
+    { FAKEKEYMOD_SHIFT,   XK_Shift_L   },
+    { FAKEKEYMOD_CONTROL, XK_Control_L },
+    { FAKEKEYMOD_ALT,     XK_Alt_L     },
+    { FAKEKEYMOD_META,    XK_Meta_L    },
+  };
+
+/* Errors on our connection are ours to deal with, see mb_kbd_inject_new() */
+static XID           InjectBadWindow = None;
+
+/* For inject_release_at_exit() */
+static MBKeyboardInjector *InjectInstance = NULL;
+
+static int
+inject_x_error_handler(Display *xdpy, XErrorEvent *error)
+{
+  DBG("X error %i on injector connection", error->error_code);
+
+  /* An IM window that went away under us */
+  if (error->error_code == BadWindow)
+    InjectBadWindow = error->resourceid;
+
+  return 0;
+}
+
+static KeySym*
+inject_keysyms_for(MBKeyboardInjector *inj, KeyCode keycode)
+{
+  return &inj->keysyms[(keycode - inj->min_keycode)
+		       * inj->keysyms_per_keycode];
+}
+
+static boolean
+inject_keycode_is_empty(MBKeyboardInjector *inj, KeyCode keycode)
+{
+  KeySym *syms = inject_keysyms_for(inj, keycode);
+  int     i;
+
+  for (i = 0; i < inj->keysyms_per_keycode; i++)
+    if (syms[i] != NoSymbol)
+      return False;
+
+  return True;
+}
+
+/*
+ * The character a keysym types, 0 for none. Latin-1 and 'Unicode'
+ * keysyms carry theirs, legacy ones are looked up in the table
+ * generated from the X headers, see names-compiler.c
+*/
+unsigned int
+mb_kbd_inject_keysym_to_ucs4 (KeySym keysym)
+{
+  unsigned int lo = 0, hi = MBKeyboardKeysymsUcs4Count;
+
+  if ((keysym & 0xff000000) == 0x01000000)
+    return keysym & 0x00ffffff;
+
+  if ((keysym >= 0x20 && keysym <= 0x7e) || (keysym >= 0xa0 && keysym <= 0xff))
+    return keysym;
+
+  while (lo < hi)
+    {
+      unsigned int mid = (lo + hi) / 2;
+
+      if (MBKeyboardKeysymsUcs4[mid].keysym == keysym)
+	return MBKeyboardKeysymsUcs4[mid].ucs4;
+
+      if (MBKeyboardKeysymsUcs4[mid].keysym < keysym)
+	lo = mid + 1;
+      else
+	hi = mid;
+    }
+
+  return 0;
+}
+
+/* What keysyms are matched by, the same for any two typing one character */
+static KeySym
+inject_keysym_key(KeySym ks)
+{
+  unsigned int ucs4;
+  KeySym       key;
+
+  if ((ucs4 = mb_kbd_inject_keysym_to_ucs4 (ks)) == 0
+      || (key = mb_kbd_inject_ucs4_to_keysym (ucs4)) == NoSymbol)
+    return ks;
+
+  return key;
+}
+
+/*
+ * Only the first two levels are looked at, like libfakekey, as they are
+ * the only ones reachable with just shift.
+*/
+static KeyCode
+inject_lookup_keysym(MBKeyboardInjector *inj, KeySym ks, boolean *shifted)
+{
+  int code, level, n_levels;
+
+  n_levels = (inj->keysyms_per_keycode > 1) ? 2 : 1;
+  ks       = inject_keysym_key(ks);
+
+  for (level = 0; level < n_levels; level++)
+    for (code = inj->min_keycode; code <= inj->max_keycode; code++)
+      if (inject_keysym_key(inject_keysyms_for(inj, code)[level]) == ks)
+	{
+	  *shifted = (level == 1);
+	  return code;
+	}
+
+  return 0;
+}
+
+static KeyCode
+inject_lookup_modifier(MBKeyboardInjector *inj, KeySym ks)
+{
+  int code, i;
+
+  for (code = inj->min_keycode; code <= inj->max_keycode; code++)
+    for (i = 0; i < inj->keysyms_per_keycode; i++)
+      if (inject_keysyms_for(inj, code)[i] == ks)
+	return code;
+
+  return 0;
+}
+
+static MBKeyboardInjectResolved*
+inject_resolved_slot(MBKeyboardInjector *inj, KeySym ks)
+{
+  unsigned int i;
+
+  i = ((unsigned int)ks * 2654435761u) & (inj->resolved_size - 1);
+
+  while (inj->resolved[i].keysym != NoSymbol && inj->resolved[i].keysym != ks)
+    i = (i + 1) & (inj->resolved_size - 1);
+
+  return &inj->resolved[i];
+}
+
+static int
+inject_count_bits(unsigned int mask)
+{
+  int n = 0;
+
+  for (; mask; mask >>= 1)
+    n += mask & 1;
+
+  return n;
+}
+
+static boolean
+inject_keycode_in_pool(MBKeyboardInjector *inj, KeyCode keycode)
+{
+  int i;
+
+  for (i = 0; i < inj->n_pool; i++)
+    if (inj->pool[i].keycode == keycode)
+      return True;
+
+  return False;
+}
+
+/*
+ * Builds the keysym -> ( keycode, group, modifiers ) table from the XKB
+ * map, keyed by inject_keysym_key(). Where a keysym can be had more than
+ * one way the lowest group, then fewest modifiers, wins. Pool keycodes
+ * are left out as they change under us without a reload.
+*/
+static void
+inject_xkb_load(MBKeyboardInjector *inj)
+{
+  XkbDescPtr   xkb;
+  unsigned int n_syms = 0;
+  int          code, group, level, i;
+
+  free(inj->resolved);
+  inj->resolved      = NULL;
+  inj->resolved_size = 0;
+
+  xkb = XkbGetMap(inj->xdpy, XkbKeyTypesMask|XkbKeySymsMask, XkbUseCoreKbd);
+
+  if (xkb == NULL)
+    return;
+
+  for (code = xkb->min_key_code; code <= xkb->max_key_code; code++)
+    n_syms += XkbKeyNumSyms(xkb, code);
+
+  for (inj->resolved_size = 64; 
+       inj->resolved_size < n_syms * 2; 
+       inj->resolved_size *= 2)
+    ;
+
+  inj->resolved = util_malloc0(sizeof(MBKeyboardInjectResolved) 
+			       * inj->resolved_size);
+
+  for (code = xkb->min_key_code; code <= xkb->max_key_code; code++)
+    {
+      if (inject_keycode_in_pool(inj, code))
+	continue;
+
+      for (group = 0; group < XkbKeyNumGroups(xkb, code); group++)
+	{
+	  XkbKeyTypePtr type = XkbKeyKeyType(xkb, code, group);
+
+	  for (level = 0; level < type->num_levels; level++)
+	    {
+	      MBKeyboardInjectResolved *slot;
+	      KeySym                    ks;
+	      unsigned int              mods = 0;
+
+	      ks = inject_keysym_key(XkbKeySymEntry(xkb, code, level, group));
+
+	      if (ks == NoSymbol)
+		continue;
+
+	      if (level > 0)
+		{
+		  for (i = 0; i < type->map_count; i++)
+		    if (type->map[i].active && type->map[i].level == level)
+		      break;
+
+		  if (i == type->map_count) /* unreachable */
+		    continue;
+
+		  mods = type->map[i].mods.mask;
+		}
+
+	      slot = inject_resolved_slot(inj, ks);
+
+	      if (slot->keysym != NoSymbol
+		  && (slot->group < group
+		      || (slot->group == group 
+			  && inject_count_bits(slot->mods) 
+			       <= inject_count_bits(mods))))
+		continue;
+
+	      slot->keysym  = ks;
+	      slot->keycode = code;
+	      slot->group   = group;
+	      slot->mods    = mods;
+	    }
+	}
+    }
+
+  XkbFreeKeyboard(xkb, 0, True);
+}
+
+static void
+inject_load_keysyms(MBKeyboardInjector *inj)
+{
+  int i, code;
+
+  if (inj->keysyms)
+    XFree(inj->keysyms);
+
+  inj->keysyms = XGetKeyboardMapping(inj->xdpy,
+				     inj->min_keycode,
+				     inj->max_keycode - inj->min_keycode + 1,
+				     &inj->keysyms_per_keycode);
+
+  /* Keep what is still ours, forget anything someone else has taken */
+  for (i = 0; i < inj->n_pool; )
+    {
+      MBKeyboardInjectPoolEntry *entry = &inj->pool[i];
+
+      if (inject_keycode_is_empty(inj, entry->keycode))
+	entry->keysym = NoSymbol;
+      else if (inject_keysyms_for(inj, entry->keycode)[0] != entry->keysym)
+	{
+	  inj->pool[i] = inj->pool[--inj->n_pool];
+	  continue;
+	}
+      i++;
+    }
+
+  /* Top up with spare keycodes, from the top where they usually are */
+  for (code = inj->max_keycode;
+       code >= inj->min_keycode && inj->n_pool < INJECT_POOL_MAX;
+       code--)
+    {
+      if (!inject_keycode_is_empty(inj, code))
+	continue;
+
+      for (i = 0; i < inj->n_pool; i++)
+	if (inj->pool[i].keycode == code)
+	  break;
+
+      if (i == inj->n_pool)
+	{
+	  inj->pool[inj->n_pool].keycode = code;
+	  inj->pool[inj->n_pool].keysym  = NoSymbol;
+	  inj->pool[inj->n_pool].used    = 0;
+	  inj->n_pool++;
+	}
+    }
+
+  DBG("%i keycodes in pool", inj->n_pool);
+
+  if (inj->have_xkb)
+    inject_xkb_load(inj);
+}
+
+#if HAVE_LINUX_UINPUT_H
+
+static void
+inject_uinput_append(MBKeyboardInjector *inj, int type, int code, int value)
+{
+  if (inj->n_events == inj->events_alloc)
+    {
+      inj->events_alloc = inj->events_alloc ? inj->events_alloc * 2 : 64;
+      inj->events = realloc(inj->events, 
+			    sizeof(struct input_event) * inj->events_alloc);
+    }
+
+  memset(&inj->events[inj->n_events], 0, sizeof(struct input_event));
+
+  inj->events[inj->n_events].type  = type;
+  inj->events[inj->n_events].code  = code;
+  inj->events[inj->n_events].value = value;
+  inj->n_events++;
+}
+
+static boolean
+inject_uinput_init(MBKeyboardInjector *inj)
+{
+  struct uinput_user_dev dev;
+  int                    code;
+
+  if ((inj->uinput_fd = open("/dev/uinput", O_WRONLY|O_CLOEXEC)) < 0)
+    {
+      fprintf(stderr, "matchbox-keyboard: unable to open /dev/uinput: %s\n",
+	      strerror(errno));
+      return False;
+    }
+
+  ioctl(inj->uinput_fd, UI_SET_EVBIT, EV_KEY);
+  ioctl(inj->uinput_fd, UI_SET_EVBIT, EV_SYN);
+
+  /* Every code the keymap has, the pool ones included */
+  for (code = inj->min_keycode; code <= inj->max_keycode; code++)
+    if (code - INJECT_EVDEV_OFFSET > 0 
+	&& code - INJECT_EVDEV_OFFSET <= KEY_MAX)
+      ioctl(inj->uinput_fd, UI_SET_KEYBIT, code - INJECT_EVDEV_OFFSET);
+
+  memset(&dev, 0, sizeof(dev));
+  snprintf(dev.name, UINPUT_MAX_NAME_SIZE, "matchbox-keyboard");
+  dev.id.bustype = BUS_VIRTUAL;
+
+  if (write(inj->uinput_fd, &dev, sizeof(dev)) != sizeof(dev)
+      || ioctl(inj->uinput_fd, UI_DEV_CREATE) < 0)
+    {
+      fprintf(stderr, "matchbox-keyboard: unable to create uinput device: %s\n",
+	      strerror(errno));
+      close(inj->uinput_fd);
+      return False;
+    }
+
+  return True;
+}
+
+#endif
+
+static void
+inject_key_event(MBKeyboardInjector *inj, KeyCode code, boolean is_press)
+{
+#if HAVE_LINUX_UINPUT_H
+  if (inj->backend == MBKeyboardInjectUInput)
+    {
+      /* Own frame each, so press + release of a key arent merged */
+      inject_uinput_append(inj, EV_KEY, code - INJECT_EVDEV_OFFSET, is_press);
+      inject_uinput_append(inj, EV_SYN, SYN_REPORT, 0);
+      return;
+    }
+#endif
+
+  XTestFakeKeyEvent(inj->xdpy, code, is_press, CurrentTime);
+  inj->keys_unsynced = True;
+}
+
+static void
+inject_flush(MBKeyboardInjector *inj)
+{
+#if HAVE_LINUX_UINPUT_H
+  if (inj->backend == MBKeyboardInjectUInput)
+    {
+      /* The kernel's events reach the server apart from our requests,
+       * any keycode just bound has to be in place before they can go.
+      */
+      if (inj->n_events > 0 && inj->remap_unsynced)
+	{
+	  XSync(inj->xdpy, False);
+	  inj->remap_unsynced = False;
+	}
+
+      if (inj->n_events > 0 
+	  && write(inj->uinput_fd, inj->events, 
+		   sizeof(struct input_event) * inj->n_events) < 0)
+	DBG("uinput write failed: %s", strerror(errno));
+
+      inj->n_events = 0;
+    }
+#endif
+
+  /* Any keymap changes still need to go, whichever backend */
+  XFlush(inj->xdpy);
+}
+
+/*
+ * Finds a keycode for ks that needs no rebinding. With XKB any group and
+ * level will do, the group and modifiers for it being latched so they
+ * only apply to the press that follows. Without, levels needing more than
+ * shift are out of reach.
+*/
+static KeyCode
+inject_resolve(MBKeyboardInjector *inj, KeySym ks, boolean *shifted)
+{
+  MBKeyboardInjectResolved *slot;
+
+  if (inj->resolved == NULL)
+    return inject_lookup_keysym(inj, ks, shifted);
+
+  slot = inject_resolved_slot(inj, inject_keysym_key(ks));
+
+  if (slot->keysym == NoSymbol)
+    return 0;
+
+  if (slot->group != inj->locked_group)
+    XkbLatchGroup(inj->xdpy, XkbUseCoreKbd, slot->group - inj->locked_group);
+
+  if (slot->mods)
+    XkbLatchModifiers(inj->xdpy, XkbUseCoreKbd, slot->mods, slot->mods);
+
+#if HAVE_LINUX_UINPUT_H
+  /* The key goes another way, the latches have to be there first */
+  if (inj->backend == MBKeyboardInjectUInput
+      && (slot->mods || slot->group != inj->locked_group))
+    XSync(inj->xdpy, False);
+#endif
+
+  return slot->keycode;
+}
+
+/* As above but without latching anything */
+static boolean
+inject_can_resolve(MBKeyboardInjector *inj, KeySym ks)
+{
+  boolean shifted;
+
+  if (inj->resolved == NULL)
+    return inject_lookup_keysym(inj, ks, &shifted) != 0;
+
+  return inject_resolved_slot(inj, inject_keysym_key(ks))->keysym != NoSymbol;
+}
+
+/*
+ * Waits till every key sent so far has been seen by the server, so the
+ * keycodes they went out on can be rebound. XTest events are requests
+ * so a sync does it. uinput ones reach the server through the kernel,
+ * which we cant wait on, so they are written and given a moment.
+*/
+static void
+inject_sync_keys(MBKeyboardInjector *inj)
+{
+  int i;
+
+#if HAVE_LINUX_UINPUT_H
+  if (inj->backend == MBKeyboardInjectUInput)
+    {
+      inject_flush(inj);
+      usleep(INJECT_UINPUT_SETTLE_US);
+    }
+#endif
+
+  XSync(inj->xdpy, False);
+  inj->keys_unsynced = False;
+
+  for (i = 0; i < inj->n_pool; i++)
+    inj->pool[i].unsynced = False;
+}
+
+static KeyCode
+inject_pool_find(MBKeyboardInjector *inj, KeySym ks)
+{
+  int i;
+
+  for (i = 0; i < inj->n_pool; i++)
+    if (inj->pool[i].keysym == ks)
+      {
+	inj->pool[i].used = ++inj->clock;
+	return inj->pool[i].keycode;
+      }
+
+  return 0;
+}
+
+static KeyCode
+inject_pool_bind(MBKeyboardInjector *inj, KeySym ks)
+{
+  MBKeyboardInjectPoolEntry *entry = NULL;
+  KeySym                    *syms;
+  int                        i;
+
+  /* Take the least recently used - never the one held down */
+  for (i = 0; i < inj->n_pool; i++)
+    {
+      if (inj->pool[i].keycode == inj->held_keycode)
+	continue;
+
+      if (entry == NULL || inj->pool[i].used < entry->used)
+	entry = &inj->pool[i];
+    }
+
+  if (entry == NULL)
+    return 0;
+
+  /* Still in flight, it must not arrive as the new keysym */
+  if (entry->unsynced)
+    inject_sync_keys(inj);
+
+  syms = inject_keysyms_for(inj, entry->keycode);
+
+  for (i = 0; i < inj->keysyms_per_keycode; i++)
+    syms[i] = NoSymbol;
+
+  /* On both levels so shift / caps lock leave it alone */
+  syms[0] = ks;
+  if (inj->keysyms_per_keycode > 1)
+    syms[1] = ks;
+
+  DBG("binding keysym 0x%lx to keycode %i", ks, entry->keycode);
+
+  /* Remember it so the MappingNotify it causes can be ignored. If we are
+   * that far behind with events the oldest just get a reload.
+  */
+  if (inj->n_serials == INJECT_SERIALS_MAX)
+    {
+      memmove(inj->serials, inj->serials + 1, 
+	      sizeof(unsigned long) * (INJECT_SERIALS_MAX - 1));
+      inj->n_serials--;
+    }
+
+  inj->serials[inj->n_serials++] = NextRequest(inj->xdpy);
+
+  /* Just the one keycode. Requests are handled in order so an XTest press
+   * that follows will see it, no need to sync. uinput ones wont, see
+   * inject_flush().
+  */
+  XChangeKeyboardMapping(inj->xdpy, entry->keycode,
+			 inj->keysyms_per_keycode, syms, 1);
+
+#if HAVE_LINUX_UINPUT_H
+  inj->remap_unsynced = True;
+#endif
+
+  entry->keysym = ks;
+  entry->used   = ++inj->clock;
+
+  return entry->keycode;
+}
+
+/*
+ * Every keymap change, ours included, comes back as a MappingNotify and
+ * refetching the whole map for each is a big cost on long non latin
+ * bursts. Ours are already reflected in our copy so are just dropped,
+ * anything else only flags a reload which is done once, on the next
+ * press, however many changes arrive before then.
+*/
+static void
+inject_mapping_notify (MBKeyboardInjector *inj, XMappingEvent *xev)
+{
+  int i;
+
+  if (xev->request != MappingKeyboard)
+    return;
+
+  for (i = 0; i < inj->n_serials; i++)
+    if (inj->serials[i] == xev->serial)
+      {
+	/* Anything older was lost track of, see below */
+	inj->n_serials -= i + 1;
+	memmove(inj->serials, inj->serials + i + 1, 
+		sizeof(unsigned long) * inj->n_serials);
+	return;
+      }
+
+  DBG("external keymap change, keycodes %i-%i", 
+      xev->first_keycode, xev->first_keycode + xev->count - 1);
+
+  inj->reload_pending = True;
+}
+
+/*
+ * Brings the modifier keys we hold down in line with modifiers, touching
+ * only those that differ. Released with the keycode they were pressed
+ * with, whatever the keymap says by then.
+*/
+static void
+inject_set_modifiers (MBKeyboardInjector *inj, int modifiers)
+{
+  int i;
+
+  for (i = 0; i < sizeof(ModifierKeysyms)/sizeof(ModifierKeysyms[0]); i++)
+    {
+      int flag = ModifierKeysyms[i].flag;
+
+      if ((modifiers & flag) && !(inj->sent_mods & flag))
+	{
+	  KeyCode mod_code;
+
+	  mod_code = inject_lookup_modifier(inj, ModifierKeysyms[i].keysym);
+
+	  if (mod_code == 0)
+	    continue;
+
+	  inject_key_event(inj, mod_code, True);
+	  inj->mod_keycodes[i] = mod_code;
+	  inj->sent_mods |= flag;
+	}
+      else if (!(modifiers & flag) && (inj->sent_mods & flag))
+	{
+	  inject_key_event(inj, inj->mod_keycodes[i], False);
+	  inj->sent_mods &= ~flag;
+	}
+    }
+}
+
+static void
+inject_do_press (MBKeyboardInjector *inj, KeySym ks, int modifiers)
+{
+  boolean pooled = True, shifted = False;
+  KeyCode code;
+  int     i;
+
+  if (inj->reload_pending)
+    {
+      inj->reload_pending = False;
+      inject_load_keysyms(inj);
+    }
+
+  /* Pool first, so keysyms in use stay at the young end of the LRU */
+  if ((code = inject_pool_find(inj, ks)) == 0)
+    {
+      if ((code = inject_resolve(inj, ks, &shifted)) != 0)
+	pooled = False;
+      else
+	code = inject_pool_bind(inj, ks);
+    }
+
+  if (code == 0)
+    return;
+
+  if (pooled)
+    for (i = 0; i < inj->n_pool; i++)
+      if (inj->pool[i].keycode == code)
+	inj->pool[i].unsynced = True;
+
+  if (shifted)
+    modifiers |= FAKEKEYMOD_SHIFT;
+
+  inject_set_modifiers (inj, modifiers);
+
+  inject_key_event(inj, code, True);
+
+  inj->held_keycode = code;
+}
+
+static void
+inject_do_release (MBKeyboardInjector *inj)
+{
+  if (inj->held_keycode == 0)
+    return;
+
+  inject_key_event(inj, inj->held_keycode, False);
+
+  /* Modifiers stay down for the next key, see inject_set_modifiers() */
+  inj->held_keycode = 0;
+}
+
+/* Lets go of everything, key included */
+static void
+inject_do_release_all (MBKeyboardInjector *inj)
+{
+  inject_do_release (inj);
+  inject_set_modifiers (inj, 0);
+}
+
+/*
+ * The keysym typing ucs4 gives. Control characters are the keys that
+ * make them, a line break being Return whichever way its written, and
+ * NoSymbol for any with no key.
+*/
+KeySym
+mb_kbd_inject_ucs4_to_keysym (unsigned int ucs4)
+{
+  switch (ucs4)
+    {
+    case '\b':  return XK_BackSpace;
+    case '\t':  return XK_Tab;
+    case '\n':
+    case '\r':  return XK_Return;
+    case 0x1b:  return XK_Escape;
+    case 0x7f:  return XK_Delete;
+    }
+
+  if (ucs4 < 0x20 || (ucs4 >= 0x80 && ucs4 < 0xa0))
+    return NoSymbol;
+
+  /* Latin-1 keysyms match their code points, the rest are 'Unicode' ones */
+  if (ucs4 <= 0xff)
+    return ucs4;
+
+  return ucs4 | 0x01000000;
+}
+
+static int
+inject_utf8_to_keysyms (const char *utf8_str, KeySym **keysyms_out)
+{
+  KeySym       *keysyms;
+  unsigned int  ucs4, prev = 0;
+  int           n = 0, len;
+
+  keysyms = malloc(sizeof(KeySym) * (strlen(utf8_str) + 1));
+
+  while (*utf8_str != '\0')
+    {
+      if ((len = util_utf8_get_char(utf8_str, &ucs4)) < 0)
+	break; 			/* Type what was valid */
+
+      utf8_str += len;
+
+      /* \r\n is the one line break */
+      if (!(ucs4 == '\n' && prev == '\r'))
+	if ((keysyms[n] = mb_kbd_inject_ucs4_to_keysym(ucs4)) != NoSymbol)
+	  n++;
+
+      prev = ucs4;
+    }
+
+  *keysyms_out = keysyms;
+
+  return n;
+}
+
+/*
+ * A whole string is bound up front, every keysym it needs that is not
+ * already there, then typed out with nothing in between. Its all a
+ * single flush, see inject_queue_drain(), so costs no round trips
+ * however long it is.
+*/
+static void
+inject_do_string (MBKeyboardInjector *inj, 
+		  KeySym             *keysyms, 
+		  int                 n_keysyms, 
+		  int                 modifiers)
+{
+  int i, n_bound = 0;
+
+  if (inj->reload_pending)
+    {
+      inj->reload_pending = False;
+      inject_load_keysyms(inj);
+    }
+
+  /* 
+   * If it needs more than the pool holds the rest get bound as typed,
+   * once the keys on the slots being reused are through, see
+   * inject_pool_bind(). Binding them all now would only throw away the
+   * first ones before they were typed.
+  */
+  for (i = 0; i < n_keysyms && n_bound < inj->n_pool - 1; i++)
+    if (inject_pool_find(inj, keysyms[i]) == 0
+	&& !inject_can_resolve(inj, keysyms[i]))
+      {
+	inject_pool_bind(inj, keysyms[i]);
+	n_bound++;
+      }
+
+  for (i = 0; i < n_keysyms; i++)
+    {
+      inject_do_press (inj, keysyms[i], modifiers);
+      inject_do_release (inj);
+    }
+}
+
+/*
+ * Text for a focused IM context that registered a window with us goes
+ * straight to it, no keymap involved. XTest input is queued in the
+ * server where a SendEvent is not, so keys already sent are synced
+ * first to keep things in order. The send is synced too, if the window
+ * has gone the BadWindow is back by then and the text gets typed.
+*/
+static void
+inject_do_commit (MBKeyboardInjector *inj, Window win, const char *utf8)
+{
+  const char *text = utf8;
+  XEvent      ev;
+  int         len, n;
+
+  if (inj->keys_unsynced)
+    {
+      XSync(inj->xdpy, False);
+      inj->keys_unsynced = False;
+    }
+
+  memset(&ev, 0, sizeof(ev));
+
+  ev.xclient.type         = ClientMessage;
+  ev.xclient.window       = win;
+  ev.xclient.message_type = inj->commit_atom;
+  ev.xclient.format       = 8;
+
+  len = strlen(utf8);
+
+  InjectBadWindow = None;
+
+  do
+    {
+      n = (len > MB_KBD_REMOTE_COMMIT_MAX) ? MB_KBD_REMOTE_COMMIT_MAX : len;
+
+      ev.xclient.data.b[0] = n;
+      if (len > n)
+	ev.xclient.data.b[0] |= MB_KBD_REMOTE_COMMIT_MORE;
+
+      memcpy(&ev.xclient.data.b[1], utf8, n);
+
+      XSendEvent(inj->xdpy, win, False, NoEventMask, &ev);
+
+      utf8 += n;
+      len  -= n;
+    }
+  while (len > 0);
+
+  XSync(inj->xdpy, False);
+
+  if (InjectBadWindow == win)
+    {
+      KeySym *keysyms;
+
+      DBG("IM window 0x%lx gone, typing instead", win);
+
+      n = inject_utf8_to_keysyms (text, &keysyms);
+      inject_do_string (inj, keysyms, n, 0);
+      free(keysyms);
+    }
+}
+
+/* 
+ * Queue, UI thread side. Single producer / single consumer so head is
+ * only ever written here and tail only by the injection thread.
+*/
+static boolean
+inject_queue_push (MBKeyboardInjector    *inj, 
+		   MBKeyboardInjectEvent *ev)
+{
+  unsigned int head, tail;
+  char         wake = 0;
+
+  head = inj->head;
+  tail = __atomic_load_n(&inj->tail, __ATOMIC_ACQUIRE);
+
+  if (head - tail == INJECT_QUEUE_SIZE)
+    return False;
+
+  inj->queue[head & (INJECT_QUEUE_SIZE - 1)] = *ev;
+
+  __atomic_store_n(&inj->head, head + 1, __ATOMIC_RELEASE);
+
+  /* Non blocking, if the pipe is full the thread is awake anyway */
+  if (write(inj->wake_fds[1], &wake, 1) < 0 && errno != EAGAIN)
+    DBG("wake failed: %s", strerror(errno));
+
+  return True;
+}
+
+/* Returns True once asked to quit, see inject_release_at_exit() */
+static boolean
+inject_queue_drain (MBKeyboardInjector *inj)
+{
+  unsigned int head, tail;
+  boolean      quit = False;
+
+  tail = inj->tail;
+  head = __atomic_load_n(&inj->head, __ATOMIC_ACQUIRE);
+
+  if (tail == head)
+    return False;
+
+  while (tail != head)
+    {
+      MBKeyboardInjectEvent *ev = &inj->queue[tail & (INJECT_QUEUE_SIZE - 1)];
+
+      switch (ev->type)
+	{
+	case MBKeyboardInjectPress:
+	  inject_do_press (inj, ev->keysym, ev->modifiers);
+	  break;
+	case MBKeyboardInjectRelease:
+	  inject_do_release (inj);
+	  break;
+	case MBKeyboardInjectString:
+	  inject_do_string (inj, ev->keysyms, ev->n_keysyms, ev->modifiers);
+	  free(ev->keysyms);
+	  break;
+	case MBKeyboardInjectCommit:
+	  inject_do_commit (inj, ev->window, ev->utf8);
+	  free(ev->utf8);
+	  break;
+	case MBKeyboardInjectReleaseModifiers:
+	  inject_do_release_all (inj);
+	  break;
+	case MBKeyboardInjectQuit:
+	  inject_do_release_all (inj);
+	  quit = True;
+	  break;
+	}
+
+      tail++;
+    }
+
+  __atomic_store_n(&inj->tail, tail, __ATOMIC_RELEASE);
+
+  /* One flush ( or write ) for the whole batch */
+  inject_flush(inj);
+
+  return quit;
+}
+
+static void*
+inject_thread (void *data)
+{
+  MBKeyboardInjector *inj = data;
+  struct pollfd       fds[2];
+  char                buf[64];
+
+  fds[0].fd     = inj->wake_fds[0];
+  fds[0].events = POLLIN;
+  fds[1].fd     = ConnectionNumber(inj->xdpy);
+  fds[1].events = POLLIN;
+
+  while (True)
+    {
+      int timeout = -1;
+
+      if (inject_queue_drain (inj))
+	{
+	  XSync(inj->xdpy, False);
+	  break;
+	}
+
+      /* Only ever MappingNotify or XKB group lock changes here */
+      while (XPending(inj->xdpy))
+	{
+	  XEvent xev;
+
+	  XNextEvent(inj->xdpy, &xev);
+
+	  if (xev.type == MappingNotify)
+	    inject_mapping_notify (inj, &xev.xmapping);
+	  else if (inj->have_xkb && xev.type == inj->xkb_event_base
+		   && ((XkbEvent *)&xev)->any.xkb_type == XkbStateNotify)
+	    inj->locked_group = ((XkbEvent *)&xev)->state.locked_group;
+	}
+
+      /* Modifiers left down with nothing else going on get let go */
+      if (inj->sent_mods && inj->held_keycode == 0)
+	timeout = INJECT_MODS_IDLE_MS;
+
+      switch (poll(fds, 2, timeout))
+	{
+	case -1:
+	  if (errno != EINTR)
+	    return NULL;
+	  break;
+	case 0:
+	  inject_set_modifiers (inj, 0);
+	  inject_flush (inj);
+	  break;
+	}
+
+      if (fds[0].revents & POLLIN)
+	while (read(inj->wake_fds[0], buf, sizeof(buf)) == sizeof(buf))
+	  ;
+    }
+
+  return NULL;
+}
+
+/*
+ * Whatever is still held down gets released, and the thread waited on so
+ * it reaches the server, before we go.
+*/
+static void
+inject_release_at_exit (void)
+{
+  MBKeyboardInjectEvent ev;
+
+  memset(&ev, 0, sizeof(ev));
+  ev.type = MBKeyboardInjectQuit;
+
+  if (inject_queue_push (InjectInstance, &ev))
+    pthread_join(InjectInstance->thread, NULL);
+}
+
+/*
+ * The injector gets its own connection and thread so the UI never waits
+ * on a keymap change or the server, and MappingNotify for our remaps is
+ * handled where they were made.
+*/
+MBKeyboardInjector*
+mb_kbd_inject_new (MBKeyboardUI *ui)
+{
+  MBKeyboardInjector *inj;
+  int                 event_base, error_base, major, minor, i;
+  char               *backend;
+
+  inj = util_malloc0(sizeof(MBKeyboardInjector));
+
+  if ((inj->xdpy = XOpenDisplay(DisplayString(mb_kbd_ui_x_display(ui)))) 
+      == NULL)
+    goto fail;
+
+  inj->commit_atom = mb_kbd_ui_x_atom(ui, MBKeyboardAtomMBIMCommit);
+
+  /* Xlib only has the one, process wide, handler. util.c hands ours on */
+  util_delegate_x_errors(inj->xdpy, inject_x_error_handler);
+
+  XDisplayKeycodes(inj->xdpy, &inj->min_keycode, &inj->max_keycode);
+
+  major = XkbMajorVersion; minor = XkbMinorVersion;
+
+  if (XkbQueryExtension(inj->xdpy, NULL, &inj->xkb_event_base, &error_base,
+			&major, &minor))
+    {
+      XkbStateRec state;
+
+      inj->have_xkb = True;
+
+      /* The locked group is what latches are relative to */
+      XkbSelectEventDetails(inj->xdpy, XkbUseCoreKbd, XkbStateNotify,
+			    XkbGroupLockMask, XkbGroupLockMask);
+
+      if (XkbGetState(inj->xdpy, XkbUseCoreKbd, &state) == Success)
+	inj->locked_group = state.locked_group;
+    }
+
+  inject_load_keysyms(inj);
+
+  if ((backend = getenv("MB_KBD_INJECT")) != NULL
+      && !strcasecmp(backend, "uinput"))
+    {
+#if HAVE_LINUX_UINPUT_H
+      if (inject_uinput_init(inj))
+	inj->backend = MBKeyboardInjectUInput;
+      else
+#endif
+	fprintf(stderr, "matchbox-keyboard: uinput unavailable, using XTest\n");
+    }
+
+  if (inj->backend == MBKeyboardInjectXTest
+      && !XTestQueryExtension(inj->xdpy, &event_base, &error_base, 
+			      &major, &minor))
+    goto fail;
+
+  if (pipe(inj->wake_fds) < 0)
+    goto fail;
+
+  for (i = 0; i < 2; i++)
+    {
+      fcntl(inj->wake_fds[i], F_SETFL, O_NONBLOCK);
+      fcntl(inj->wake_fds[i], F_SETFD, FD_CLOEXEC);
+    }
+
+  if (pthread_create(&inj->thread, NULL, inject_thread, inj) != 0)
+    goto fail;
+
+  InjectInstance = inj;
+  atexit(inject_release_at_exit);
+
+  return inj;
+
+ fail:
+#if HAVE_LINUX_UINPUT_H
+  if (inj->backend == MBKeyboardInjectUInput)
+    close(inj->uinput_fd);
+#endif
+  if (inj->xdpy)
+    {
+      util_delegate_x_errors(NULL, NULL);
+      XCloseDisplay(inj->xdpy);
+    }
+  free(inj);
+  return NULL;
+}
+
+void
+mb_kbd_inject_press_keysym (MBKeyboardInjector *inj,
+			    KeySym              ks,
+			    int                 modifiers)
+{
+  MBKeyboardInjectEvent ev;
+
+  if (ks == NoSymbol)
+    return;
+
+  memset(&ev, 0, sizeof(ev));
+  ev.type      = MBKeyboardInjectPress;
+  ev.keysym    = ks;
+  ev.modifiers = modifiers;
+
+  if (!inject_queue_push (inj, &ev))
+    {
+      /* Only if the thread is wedged. Drop the release too so we 
+       * dont release what it is still holding from before.
+      */
+      fprintf(stderr, "matchbox-keyboard: injection queue full, dropping key\n");
+      inj->dropped_press = True;
+    }
+}
+
+void
+mb_kbd_inject_press (MBKeyboardInjector *inj,
+		     const char         *utf8_char_in,
+		     int                 modifiers)
+{
+  unsigned int ucs4;
+
+  if (util_utf8_get_char(utf8_char_in, &ucs4) < 0)
+    return;
+
+  mb_kbd_inject_press_keysym (inj, mb_kbd_inject_ucs4_to_keysym(ucs4), 
+			      modifiers);
+}
+
+void
+mb_kbd_inject_string (MBKeyboardInjector *inj,
+		      const char         *utf8_str,
+		      int                 modifiers)
+{
+  MBKeyboardInjectEvent ev;
+
+  memset(&ev, 0, sizeof(ev));
+  ev.type      = MBKeyboardInjectString;
+  ev.modifiers = modifiers;
+  ev.n_keysyms = inject_utf8_to_keysyms (utf8_str, &ev.keysyms);
+
+  if (ev.n_keysyms == 0 || !inject_queue_push (inj, &ev))
+    {
+      if (ev.n_keysyms)
+	fprintf(stderr, "matchbox-keyboard: injection queue full, dropping string\n");
+      free(ev.keysyms);
+    }
+}
+
+void
+mb_kbd_inject_commit (MBKeyboardInjector *inj,
+		      Window              win,
+		      const char         *utf8_str,
+		      int                 len)
+{
+  MBKeyboardInjectEvent ev;
+
+  if (len < 0)
+    len = strlen(utf8_str);
+
+  if (len == 0)
+    return;
+
+  memset(&ev, 0, sizeof(ev));
+  ev.type   = MBKeyboardInjectCommit;
+  ev.window = win;
+  ev.utf8   = malloc(len + 1);
+
+  memcpy(ev.utf8, utf8_str, len);
+  ev.utf8[len] = '\0';
+
+  if (!inject_queue_push (inj, &ev))
+    {
+      fprintf(stderr, "matchbox-keyboard: injection queue full, dropping string\n");
+      free(ev.utf8);
+    }
+}
+
+void
+mb_kbd_inject_release (MBKeyboardInjector *inj)
+{
+  MBKeyboardInjectEvent ev;
+
+  if (inj->dropped_press)
+    {
+      inj->dropped_press = False;
+      return;
+    }
+
+  memset(&ev, 0, sizeof(ev));
+  ev.type = MBKeyboardInjectRelease;
+
+  if (!inject_queue_push (inj, &ev))
+    fprintf(stderr, "matchbox-keyboard: injection queue full, dropping key\n");
+}
+
+void
+mb_kbd_inject_release_modifiers (MBKeyboardInjector *inj)
+{
+  MBKeyboardInjectEvent ev;
+
+  memset(&ev, 0, sizeof(ev));
+  ev.type = MBKeyboardInjectReleaseModifiers;
+
+  if (!inject_queue_push (inj, &ev))
+    fprintf(stderr, "matchbox-keyboard: injection queue full, modifiers left held\n");
+}
@@ -41,6 +41,7 @@ typedef struct MBKeyboardKeyAction
   union 
   {
     char                  *glyph;
+    char                  *string;
     KeySym                 keysym;
     MBKeyboardKeyModType   type;
   } u;
@@ -99,6 +100,34 @@ mb_kbd_key_new(MBKeyboard *kbd)
   return key;
 }
 
+void
+mb_kbd_key_destroy(MBKeyboardKey *key)
+{
+  int i;
+
+  for (i=0; i<N_MBKeyboardKeyStateTypes; i++)
+    {
+      MBKeyboardKeyState *state = key->states[i];
+
+      if (state == NULL)
+	continue;
+
+      if (state->face.type == MBKeyboardKeyFaceGlyph)
+	free(state->face.u.str);
+      else if (state->face.type == MBKeyboardKeyFaceImage)
+	mb_kbd_image_destroy(state->face.u.image);
+
+      if (state->action.type == MBKeyboardKeyActionGlyph)
+	free(state->action.u.glyph);
+      else if (state->action.type == MBKeyboardKeyActionString)
+	free(state->action.u.string);
+
+      free(state);
+    }
+
+  free(key);
+}
+
 void
 mb_kbd_key_set_obey_caps(MBKeyboardKey  *key, boolean obey)
 {
@@ -333,6 +362,29 @@ mb_kbd_key_get_char_action(MBKeyboardKey           *key,
   return NULL;
 }
 
+void
+mb_kbd_key_set_string_action(MBKeyboardKey           *key,
+			     MBKeyboardKeyStateType   state,
+			     const char              *string)
+{
+  if (key->states[state] == NULL)
+    _mb_kbd_key_init_state(key, state);
+  
+  key->states[state]->action.type = MBKeyboardKeyActionString;
+  key->states[state]->action.u.string = strdup(string);
+}
+
+const char*
+mb_kbd_key_get_string_action(MBKeyboardKey           *key,
+			     MBKeyboardKeyStateType   state)
+{
+  if (key->states[state] 
+      && key->states[state]->action.type == MBKeyboardKeyActionString)
+    return key->states[state]->action.u.string;
+
+  return NULL;
+}
+
 void
 mb_kbd_key_set_keysym_action(MBKeyboardKey           *key,
 			     MBKeyboardKeyStateType   state,
@@ -410,6 +462,7 @@ mb_kbd_key_press(MBKeyboardKey *key)
 	  //MBKeyboardKeyStateType state = mb_kbd_keys_current_state(key->kbd);
 	  //int flags = 0;
 	  boolean queue_full_kbd_redraw = True;
+	  long long start = mb_kbd_latency_begin();
 
 	  if (! key || mb_kbd_key_is_blank(key))
 	  {
@@ -423,6 +476,8 @@ mb_kbd_key_press(MBKeyboardKey *key)
 		mb_kbd_redraw(key->kbd);
 	else
 		mb_kbd_redraw_key(key->kbd, key);
+
+	mb_kbd_latency_end (MBKeyboardLatencyKeyPress, start);
 }
 
 boolean 
@@ -499,6 +554,7 @@ void
 mb_kbd_key_release_send(MBKeyboard *kbd, Bool bSendKey)
 {
 	MBKeyboardKey *key 			= mb_kbd_get_held_key(kbd);
+	long long      start			= mb_kbd_latency_begin();
 	
 	if (! key) return;
 	
@@ -540,6 +596,14 @@ mb_kbd_key_release_send(MBKeyboard *kbd, Bool bSendKey)
 				  }
 				break;
 			}
+			case MBKeyboardKeyActionString:
+			{
+				const char *str;
+
+				if ((str = mb_kbd_key_get_string_action(key, state)) != NULL)
+					mb_kbd_ui_send_string(key->kbd->ui, str, flags);
+				break;
+			}
 			case MBKeyboardKeyActionXKeySym:
 			{
 				KeySym ks;
@@ -624,6 +688,8 @@ mb_kbd_key_release_send(MBKeyboard *kbd, Bool bSendKey)
 		mb_kbd_redraw(key->kbd);
 	else
 		mb_kbd_redraw_key(key->kbd, key);
+
+	mb_kbd_latency_end (MBKeyboardLatencyKeyRelease, start);
 }
 
 void
@@ -0,0 +1,237 @@
+/*
+ *  Matchbox Keyboard - A lightweight software keyboard.
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2, or (at your option)
+ *  any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ */
+
+/*
+ * Latency instrumentation. Each phase keeps a log bucketed histogram
+ * of its durations in usecs ( 4 sub buckets per power of two, so any
+ * reported value is within 25% of the real one ). Enabled by setting
+ * MB_KBD_LATENCY in the environment, dumped on SIGUSR1 and on exit
+ * ( including SIGTERM/SIGINT, see mb_kbd_signals_init() ).
+ */
+
+#include "matchbox-keyboard.h"
+
+#define LATENCY_SUB_BITS   2
+#define LATENCY_N_SUBS     (1 << LATENCY_SUB_BITS)
+#define LATENCY_N_BUCKETS  (32 * LATENCY_N_SUBS)
+
+typedef struct MBKeyboardLatencyHist
+{
+  unsigned long counts[LATENCY_N_BUCKETS];
+  unsigned long n;
+  unsigned long max;
+}
+MBKeyboardLatencyHist;
+
+static char *PhaseNames[] =
+  {
+    "event",            /* MBKeyboardLatencyEvent */
+    "key-press",        /* MBKeyboardLatencyKeyPress */
+    "key-release",      /* MBKeyboardLatencyKeyRelease */
+    "redraw",           /* MBKeyboardLatencyRedraw */
+    "input-to-inject",  /* MBKeyboardLatencyInputToInject */
+    "input-to-present", /* MBKeyboardLatencyInputToPresent */
+    "show",             /* MBKeyboardLatencyShow */
+  };
+
+static MBKeyboardLatencyHist  Hists[N_MBKeyboardLatencyPhases];
+static boolean                Enabled = False;
+
+/* Server timestamp of the input event currently being handled, and the
+ * smallest ( local - server ) clock offset seen. As the fastest event
+ * seen had ~0 delivery latency, this maps server time onto ours without
+ * needing the clocks to agree ( think remote displays ).
+*/
+static Time                   EventTime = CurrentTime;
+static boolean                HaveOffset = False;
+static long                   MinOffset;
+
+static int
+latency_bucket (unsigned long usec)
+{
+  int msb = 0;
+
+  if (usec < LATENCY_N_SUBS)
+    return usec;
+
+  while ((usec >> msb) > 1)
+    msb++;
+
+  if (msb > 31)
+    return LATENCY_N_BUCKETS - 1;
+
+  return ((msb - LATENCY_SUB_BITS + 1) << LATENCY_SUB_BITS)
+           + ((usec >> (msb - LATENCY_SUB_BITS)) & (LATENCY_N_SUBS - 1));
+}
+
+static unsigned long
+latency_bucket_upper (int bucket)
+{
+  int k, sub;
+
+  if (bucket < LATENCY_N_SUBS)
+    return bucket;
+
+  k   = bucket >> LATENCY_SUB_BITS;
+  sub = bucket & (LATENCY_N_SUBS - 1);
+
+  return ((unsigned long)(LATENCY_N_SUBS + sub + 1) << (k - 1)) - 1;
+}
+
+static unsigned long
+latency_percentile (MBKeyboardLatencyHist *hist, int percent)
+{
+  unsigned long want, seen = 0;
+  int           i;
+
+  if (hist->n == 0)
+    return 0;
+
+  want = (hist->n * percent + 99) / 100;
+
+  for (i = 0; i < LATENCY_N_BUCKETS; i++)
+    {
+      seen += hist->counts[i];
+
+      if (seen >= want)
+	{
+	  unsigned long upper = latency_bucket_upper(i);
+	  return (upper > hist->max) ? hist->max : upper;
+	}
+    }
+
+  return hist->max;
+}
+
+static void
+latency_dump_at_exit (void)
+{
+  mb_kbd_latency_dump (stderr);
+}
+
+void
+mb_kbd_latency_init (void)
+{
+  if (getenv("MB_KBD_LATENCY") == NULL)
+    return;
+
+  Enabled = True;
+
+  atexit(latency_dump_at_exit);
+}
+
+boolean
+mb_kbd_latency_enabled (void)
+{
+  return Enabled;
+}
+
+long long
+mb_kbd_latency_begin (void)
+{
+  if (!Enabled)
+    return 0;
+
+  return util_monotonic_usec();
+}
+
+void
+mb_kbd_latency_end (MBKeyboardLatencyPhase phase, long long start)
+{
+  if (!Enabled || start == 0)
+    return;
+
+  mb_kbd_latency_record (phase, util_monotonic_usec() - start);
+}
+
+void
+mb_kbd_latency_record (MBKeyboardLatencyPhase phase, long long usec)
+{
+  MBKeyboardLatencyHist *hist;
+
+  if (!Enabled)
+    return;
+
+  if (usec < 0)
+    usec = 0;
+
+  hist = &Hists[phase];
+
+  hist->counts[latency_bucket(usec)]++;
+  hist->n++;
+
+  if (usec > hist->max)
+    hist->max = usec;
+}
+
+void
+mb_kbd_latency_set_event_time (Time server_time)
+{
+  long offset;
+
+  if (!Enabled)
+    return;
+
+  EventTime = server_time;
+
+  if (server_time == CurrentTime)
+    return;
+
+  /* both clocks in ms, wrapping at 32 bits like X Time does */
+  offset = (long)(int)((unsigned int)(util_monotonic_usec() / 1000)
+		       - (unsigned int)server_time);
+
+  if (!HaveOffset || offset < MinOffset)
+    {
+      MinOffset  = offset;
+      HaveOffset = True;
+    }
+}
+
+void
+mb_kbd_latency_record_since_event (MBKeyboardLatencyPhase phase)
+{
+  long offset;
+
+  if (!Enabled || EventTime == CurrentTime)
+    return;
+
+  offset = (long)(int)((unsigned int)(util_monotonic_usec() / 1000)
+		       - (unsigned int)EventTime);
+
+  mb_kbd_latency_record (phase, (long long)(offset - MinOffset) * 1000);
+}
+
+void
+mb_kbd_latency_dump (FILE *fp)
+{
+  int i;
+
+  if (!Enabled)
+    return;
+
+  fprintf(fp, "matchbox-keyboard: latency (usec) %10s %10s %10s %10s\n",
+	  "count", "p50", "p99", "max");
+
+  for (i = 0; i < N_MBKeyboardLatencyPhases; i++)
+    fprintf(fp, "  %-31s %10lu %10lu %10lu %10lu\n",
+	    PhaseNames[i],
+	    Hists[i].n,
+	    latency_percentile(&Hists[i], 50),
+	    latency_percentile(&Hists[i], 99),
+	    Hists[i].max);
+
+  fflush(fp);
+}
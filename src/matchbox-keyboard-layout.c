@@ -24,6 +24,11 @@ struct MBKeyboardLayout
   MBKeyboard       *kbd;  
   char             *id;
   List             *rows;
+
+  /* The ops it is built from, see config-loader.c */
+  const MBKeyboardConfigOps *ops;
+  int                        ops_start, ops_end;
+  boolean                    built;
 };
 
 
@@ -40,6 +45,27 @@ mb_kbd_layout_new(MBKeyboard *kbd, const char *id)
   return layout;
 }
 
+void
+mb_kbd_layout_destroy(MBKeyboardLayout *layout)
+{
+  List *row_item;
+
+  for (row_item = mb_kbd_layout_rows(layout); 
+       row_item != NULL; 
+       row_item = util_list_next(row_item))
+    mb_kbd_row_destroy(row_item->data);
+
+  util_list_free(layout->rows);
+  free(layout->id);
+  free(layout);
+}
+
+const char*
+mb_kbd_layout_id(MBKeyboardLayout *layout)
+{
+  return layout->id;
+}
+
 void
 mb_kbd_layout_append_row(MBKeyboardLayout *layout,
 			 MBKeyboardRow    *row)
@@ -53,3 +79,36 @@ mb_kbd_layout_rows(MBKeyboardLayout *layout)
   return util_list_get_first(layout->rows);
 }
 
+void
+mb_kbd_layout_set_ops(MBKeyboardLayout          *layout,
+		      const MBKeyboardConfigOps *ops,
+		      int                        start,
+		      int                        end)
+{
+  layout->ops       = ops;
+  layout->ops_start = start;
+  layout->ops_end   = end;
+}
+
+const MBKeyboardConfigOps*
+mb_kbd_layout_get_ops(MBKeyboardLayout *layout,
+		      int              *start,
+		      int              *end)
+{
+  *start = layout->ops_start;
+  *end   = layout->ops_end;
+
+  return layout->ops;
+}
+
+void
+mb_kbd_layout_set_built(MBKeyboardLayout *layout, boolean built)
+{
+  layout->built = built;
+}
+
+boolean
+mb_kbd_layout_is_built(MBKeyboardLayout *layout)
+{
+  return layout->built;
+}
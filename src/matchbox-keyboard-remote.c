@@ -20,15 +20,6 @@
 #include "matchbox-keyboard.h"
 #include "matchbox-keyboard-remote.h"
 
-static Atom Atom_MB_IM_INVOKER_COMMAND;
-
-void
-mb_kbd_remote_init (MBKeyboardUI *ui)
-{
-  Atom_MB_IM_INVOKER_COMMAND = XInternAtom(mb_kbd_ui_x_display(ui), 
-					   "_MB_IM_INVOKER_COMMAND", False);
-}
-
 MBKeyboardRemoteOperation
 mb_kbd_remote_process_xevents (MBKeyboardUI *ui, XEvent *xevent)
 {
@@ -38,10 +29,18 @@ mb_kbd_remote_process_xevents (MBKeyboardUI *ui, XEvent *xevent)
     {
     case ClientMessage:
       DBG("is a Client Message\n");
-      if (xevent->xclient.message_type == Atom_MB_IM_INVOKER_COMMAND)
+      if (xevent->xclient.message_type 
+	  == mb_kbd_ui_x_atom(ui, MBKeyboardAtomMBIMInvokerCommand))
         {
 	  DBG("got a message of type _MB_IM_INVOKER_COMMAND, val %lu\n",
 	      xevent->xclient.data.l[0]);
+
+	  /* Where to send text, if the IM module wants it directly */
+	  if (xevent->xclient.data.l[0] == MBKeyboardRemoteShow)
+	    mb_kbd_ui_set_im_window(ui, xevent->xclient.data.l[1]);
+	  else if (xevent->xclient.data.l[0] == MBKeyboardRemoteHide)
+	    mb_kbd_ui_set_im_window(ui, None);
+
 	  return xevent->xclient.data.l[0];
 	}
     }
@@ -27,4 +27,14 @@ typedef enum {
   MBKeyboardRemoteToggle,
 } MBKeyboardRemoteOperation;
 
+/* 
+ * MBKeyboardRemoteShow can carry a window in data.l[1]. Text is then
+ * sent straight to it, rather than typed, as format 8 ClientMessages of
+ * this type. data.b[0] is the number of bytes of UTF8 that follow, with
+ * MB_KBD_REMOTE_COMMIT_MORE set if the text carries on in the next one.
+*/
+#define MB_KBD_REMOTE_COMMIT_ATOM "_MB_IM_COMMIT"
+#define MB_KBD_REMOTE_COMMIT_MAX  19
+#define MB_KBD_REMOTE_COMMIT_MORE 0x80
+
 #endif
@@ -38,6 +38,18 @@ mb_kbd_row_new(MBKeyboard *kbd)
   return row;
 }
 
+void
+mb_kbd_row_destroy(MBKeyboardRow *row)
+{
+  List *key_item;
+
+  mb_kbd_row_for_each_key(row, key_item)
+    mb_kbd_key_destroy(key_item->data);
+
+  util_list_free(row->keys);
+  free(row);
+}
+
 void
 mb_kbd_row_set_x(MBKeyboardRow *row, int x)
 {
@@ -148,3 +160,20 @@ mb_kdb_row_keys(MBKeyboardRow *row)
 {
   return util_list_get_first(row->keys);
 }
+
+/* Swaps in key for old, which is left to the caller */
+void
+mb_kbd_row_replace_key(MBKeyboardRow *row,
+		       MBKeyboardKey *old,
+		       MBKeyboardKey *key)
+{
+  List *key_item;
+
+  mb_kbd_row_for_each_key(row, key_item)
+    if (key_item->data == old)
+      {
+	key_item->data = key;
+	mb_kbd_key_set_row(key, row);
+	return;
+      }
+}
@@ -0,0 +1,130 @@
+/*
+ *  Matchbox Keyboard - A lightweight software keyboard.
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2, or (at your option)
+ *  any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ */
+
+/*
+ * Startup profile. The end of each phase of getting from exec to the
+ * first paint is timestamped as it is reached ( always, its one clock
+ * read a phase ), each phase's time being from the previous one reached.
+ * With --profile-startup <file> or MB_KBD_PROFILE_STARTUP=<file> a table
+ * is printed to stderr once we're up, and the same written to file as
+ * JSON, for comparing releases.
+ */
+
+#include "matchbox-keyboard.h"
+
+static char *PhaseNames[] =
+  {
+    "x-connect",      /* MBKeyboardStartupXConnect */
+    "injector",       /* MBKeyboardStartupInjector */
+    "ui-init",        /* MBKeyboardStartupUIInit */
+    "config-load",    /* MBKeyboardStartupConfigLoad */
+    "image-decode",   /* MBKeyboardStartupImageDecode */
+    "layout-build",   /* MBKeyboardStartupLayoutBuild */
+    "font-load",      /* MBKeyboardStartupFontLoad */
+    "layout-alloc",   /* MBKeyboardStartupLayoutAlloc */
+    "wm-check",       /* MBKeyboardStartupWMCheck */
+    "window-create",  /* MBKeyboardStartupWindowCreate */
+    "first-paint",    /* MBKeyboardStartupFirstPaint */
+  };
+
+static long long  Start;
+static long long  Marks[N_MBKeyboardStartupPhases];
+static char      *Output = NULL;
+
+void
+mb_kbd_startup_begin (void)
+{
+  Start = util_monotonic_usec();
+
+  if (getenv("MB_KBD_PROFILE_STARTUP") && *getenv("MB_KBD_PROFILE_STARTUP"))
+    mb_kbd_startup_set_output (getenv("MB_KBD_PROFILE_STARTUP"));
+}
+
+/* Where the profile is written, setting it turns profiling on */
+void
+mb_kbd_startup_set_output (const char *path)
+{
+  free(Output);
+  Output = strdup(path);
+}
+
+boolean
+mb_kbd_startup_enabled (void)
+{
+  return Output != NULL;
+}
+
+/* phase is over, only the first time counts */
+void
+mb_kbd_startup_mark (MBKeyboardStartupPhase phase)
+{
+  if (Marks[phase] == 0)
+    Marks[phase] = util_monotonic_usec();
+}
+
+/* Phases not reached ( eg no paint for a daemon ) are -1 */
+static long long
+startup_duration (int phase)
+{
+  long long prev = Start;
+  int       i;
+
+  if (Marks[phase] == 0)
+    return -1;
+
+  for (i = 0; i < phase; i++)
+    if (Marks[i] != 0)
+      prev = Marks[i];
+
+  return Marks[phase] - prev;
+}
+
+/* Up and running, reports the profile if wanted */
+void
+mb_kbd_startup_done (void)
+{
+  long long  total = util_monotonic_usec() - Start;
+  FILE      *fp;
+  int        i;
+
+  if (Output == NULL)
+    return;
+
+  fprintf(stderr, "matchbox-keyboard: startup (usec) %10s\n", "time");
+
+  for (i = 0; i < N_MBKeyboardStartupPhases; i++)
+    if (Marks[i] != 0)
+      fprintf(stderr, "  %-31s %10lli\n", PhaseNames[i], startup_duration(i));
+    else
+      fprintf(stderr, "  %-31s %10s\n", PhaseNames[i], "-");
+
+  fprintf(stderr, "  %-31s %10lli\n", "total", total);
+
+  if ((fp = fopen(Output, "w")) == NULL)
+    {
+      fprintf(stderr, "matchbox-keyboard: unable to write %s\n", Output);
+      return;
+    }
+
+  fprintf(fp, "{\n  \"version\": \"%s\",\n  \"phases\": {\n", VERSION);
+
+  for (i = 0; i < N_MBKeyboardStartupPhases; i++)
+    fprintf(fp, "    \"%s\": %lli%s\n", PhaseNames[i], startup_duration(i),
+	    (i + 1 < N_MBKeyboardStartupPhases) ? "," : "");
+
+  fprintf(fp, "  },\n  \"total\": %lli\n}\n", total);
+
+  fclose(fp);
+}
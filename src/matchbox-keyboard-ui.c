@@ -20,6 +20,11 @@
  */
 
 #include "matchbox-keyboard.h"
+#include <errno.h>
+
+#if HAVE_XRANDR
+#include <X11/extensions/Xrandr.h>
+#endif
 
 #define PROP_MOTIF_WM_HINTS_ELEMENTS    5
 #define MWM_HINTS_DECORATIONS          (1L << 1)
@@ -43,6 +48,7 @@ struct MBKeyboardUI
   Pixmap              backbuffer;
 
   int                 dpy_width, dpy_height;
+  int                 xwin_x, xwin_y; /* root relative, as last known */
   int                 xwin_width, xwin_height;
   int			kbd_width, kbd_height;		// The width and height of the keyboard window.
   int			imyh;
@@ -60,14 +66,58 @@ struct MBKeyboardUI
   int			x_shift;
   int			y_shift;
   Bool                invert;
-  FakeKey             *fakekey;
+  Bool                waiting_for_wm; /* daemon started before the WM */
+  Bool                show_pending;   /* show requested while waiting */
+  Bool                frame_stale;    /* backbuffer behind, see redraw */
+  Bool                win_prop_stale; /* WM dropped our _NET_WM_STATE */
+  Window              wm_check_xwin;
+  Window              im_window;      /* focused IM context, takes text */
+  Bool                configure_pending; /* resize waiting to settle */
+  int                 configure_width, configure_height;
+  long long           configure_deadline;
+  MBKeyboardInjector  *injector;
   MBKeyboardUIBackend *backend; 
   MBKeyboard          *kbd;
 
   MBKeyboardDisplayOrientation dpy_orientation;
   MBKeyboardDisplayOrientation valid_orientation;
+
+  Atom                atoms[N_MBKeyboardAtoms];
+
+#if HAVE_XRANDR
+  Bool                have_xrandr;
+  int                 xrandr_event_base;
+
+  /* CRTC geometry, fetched once then kept current from RRNotify events */
+  int                 n_crtcs;
+  RRCrtc             *crtcs;
+  XRectangle         *crtc_rects;
+  int                 crtc_index; /* the one we are on, or -1 */
+#endif
 };
 
+/* Must match MBKeyboardAtomType order */
+static char *AtomNames[] =
+  {
+    "_NET_SUPPORTING_WM_CHECK",
+    "_NET_WM_NAME",
+    "UTF8_STRING",
+    "_NET_WORKAREA",
+    "_NET_WM_STATE",
+    "_NET_WM_STATE_SKIP_PAGER",
+    "_NET_WM_STATE_SKIP_TASKBAR",
+    "_OB_WM_STATE_UNDECORATED",
+    "_NET_WM_WINDOW_TYPE",
+    "_NET_WM_WINDOW_TYPE_TOOLBAR",
+    "_NET_WM_WINDOW_TYPE_DOCK",
+    "_NET_WM_STRUT_PARTIAL",
+    "_MOTIF_WM_HINTS",
+    "_XEMBED",
+    "_XEMBED_INFO",
+    "_MB_IM_INVOKER_COMMAND",
+    MB_KBD_REMOTE_COMMIT_ATOM,
+  };
+
 x_shift=0;
 y_shift=0;
 
@@ -77,35 +127,58 @@ mb_kbd_ui_resize(MBKeyboardUI *ui, int width, int height);
 static int
 mb_kbd_ui_load_font(MBKeyboardUI *ui);
 
+static void
+mb_kbd_ui_configure_idle(MBKeyboardUI *ui);
 
-static char*
-get_current_window_manager_name (MBKeyboardUI  *ui)
+
+static Window
+get_wm_check_window (MBKeyboardUI  *ui)
 {
-  Atom           atom_utf8_string, atom_wm_name, atom_check, type;
-  int            result, format;
-  char          *val, *retval;
+  Atom           type;
+  int            format;
   unsigned long  nitems, bytes_after;
-  Window        *support_xwin = NULL;
-
-  atom_check = XInternAtom (ui->xdpy, "_NET_SUPPORTING_WM_CHECK", False);
+  Window        *support_xwin = NULL, result;
 
   XGetWindowProperty (ui->xdpy, 
 		      RootWindow(ui->xdpy, ui->xscreen),
-		      atom_check,
+		      ui->atoms[MBKeyboardAtomNetSupportingWMCheck],
 		      0, 16L, False, XA_WINDOW, &type, &format,
 		      &nitems, &bytes_after, (unsigned char **)&support_xwin);
 
   if (support_xwin == NULL)
+      return None;
+
+  result = (nitems > 0) ? *support_xwin : None;
+
+  XFree (support_xwin);
+
+  return result;
+}
+
+static char*
+get_current_window_manager_name (MBKeyboardUI  *ui)
+{
+  Atom           atom_utf8_string, atom_wm_name, type;
+  int            result, format;
+  char          *val = NULL, *retval;
+  unsigned long  nitems, bytes_after;
+  Window         support_xwin;
+
+  atom_utf8_string = ui->atoms[MBKeyboardAtomUTF8String];
+  atom_wm_name     = ui->atoms[MBKeyboardAtomNetWMName];
+
+  if ((support_xwin = get_wm_check_window (ui)) == None)
       return NULL;
 
-  atom_utf8_string = XInternAtom (ui->xdpy, "UTF8_STRING", False);
-  atom_wm_name     = XInternAtom (ui->xdpy, "_NET_WM_NAME", False);
+  /* The check window may already be gone if the WM is restarting */
+  util_trap_x_errors();
 
-  result = XGetWindowProperty (ui->xdpy, *support_xwin, atom_wm_name,
+  result = XGetWindowProperty (ui->xdpy, support_xwin, atom_wm_name,
 			       0, 1000L,False, atom_utf8_string,
 			       &type, &format, &nitems,
 			       &bytes_after, (unsigned char **)&val);
-  if (result != Success)
+
+  if (util_untrap_x_errors() || result != Success)
     return NULL;
 
   if (type != atom_utf8_string || format !=8 || nitems == 0)
@@ -128,7 +201,8 @@ get_desktop_area(MBKeyboardUI *ui, int *x, int *y, int *width, int *height)
   int            result, format;
   unsigned long  nitems, bytes_after;
   int           *geometry = NULL;
-  atom_area = XInternAtom (ui->xdpy, "_NET_WORKAREA", False);
+
+  atom_area = ui->atoms[MBKeyboardAtomNetWorkarea];
 
   result = XGetWindowProperty (ui->xdpy, 
 			       RootWindow(ui->xdpy, ui->xscreen),
@@ -155,19 +229,18 @@ get_desktop_area(MBKeyboardUI *ui, int *x, int *y, int *width, int *height)
   return True;
 }
 
+/* 
+ * Display size is never asked for, it is taken from the connection setup
+ * then tracked from RandR screen change events ( or root ConfigureNotify
+ * without RandR ) so rotations never wait on the server.
+*/
 static void
-update_display_size(MBKeyboardUI *ui)
+set_display_size(MBKeyboardUI *ui, int width, int height)
 {
-  XWindowAttributes winattr;
-
   MARK();
 
-  XGetWindowAttributes(ui->xdpy, ui->xwin_root, &winattr);
-
-  /* XXX should actually trap an X error here */
-
-ui->dpy_width  = winattr.width;
- ui->dpy_height = winattr.height;
+  ui->dpy_width  = width;
+  ui->dpy_height = height;
 
   if (ui->dpy_width > ui->dpy_height)
     ui->dpy_orientation = MBKeyboardDisplayLandscape;
@@ -183,6 +256,148 @@ ui->dpy_width  = winattr.width;
   return;
 }
 
+#if HAVE_XRANDR
+
+static void
+xrandr_update_crtc(MBKeyboardUI *ui)
+{
+  int i, cx, cy;
+
+  /* Whichever CRTC has our center on it */
+  cx = ui->xwin_x + ui->xwin_width / 2;
+  cy = ui->xwin_y + ui->xwin_height / 2;
+
+  ui->crtc_index = -1;
+
+  for (i = 0; i < ui->n_crtcs; i++)
+    {
+      XRectangle *r = &ui->crtc_rects[i];
+
+      if (r->width == 0 || r->height == 0) /* disabled */
+	continue;
+
+      if (ui->crtc_index == -1)
+	ui->crtc_index = i; 	/* Fall back to the first one lit */
+
+      if (cx >= r->x && cx < r->x + r->width
+	  && cy >= r->y && cy < r->y + r->height)
+	{
+	  ui->crtc_index = i;
+	  break;
+	}
+    }
+
+  DBG("on crtc %i", ui->crtc_index);
+}
+
+static void
+xrandr_init(MBKeyboardUI *ui)
+{
+  XRRScreenResources *res;
+  int                 error_base, major = 0, minor = 0, i;
+
+  ui->crtc_index = -1;
+
+  if (!XRRQueryExtension(ui->xdpy, &ui->xrandr_event_base, &error_base))
+    return;
+
+  XRRQueryVersion(ui->xdpy, &major, &minor);
+
+  ui->have_xrandr = True;
+
+  if (major > 1 || (major == 1 && minor >= 2))
+    {
+      XRRSelectInput(ui->xdpy, ui->xwin_root, 
+		     RRScreenChangeNotifyMask|RRCrtcChangeNotifyMask);
+
+      /* The only time we ask, after this RRNotify keeps us current. A
+       * 1.2 server has no 'Current', which means it probes the outputs.
+      */
+      if (major == 1 && minor == 2)
+	res = XRRGetScreenResources(ui->xdpy, ui->xwin_root);
+      else
+	res = XRRGetScreenResourcesCurrent(ui->xdpy, ui->xwin_root);
+
+      if (res == NULL)
+	return;
+
+      ui->n_crtcs    = res->ncrtc;
+      ui->crtcs      = util_malloc0(sizeof(RRCrtc) * (res->ncrtc + 1));
+      ui->crtc_rects = util_malloc0(sizeof(XRectangle) * (res->ncrtc + 1));
+
+      for (i = 0; i < res->ncrtc; i++)
+	{
+	  XRRCrtcInfo *info;
+
+	  ui->crtcs[i] = res->crtcs[i];
+
+	  if ((info = XRRGetCrtcInfo(ui->xdpy, res, res->crtcs[i])) == NULL)
+	    continue;
+
+	  if (info->mode != None)
+	    {
+	      ui->crtc_rects[i].x      = info->x;
+	      ui->crtc_rects[i].y      = info->y;
+	      ui->crtc_rects[i].width  = info->width;
+	      ui->crtc_rects[i].height = info->height;
+	    }
+
+	  XRRFreeCrtcInfo(info);
+	}
+
+      XRRFreeScreenResources(res);
+    }
+  else
+    XRRSelectInput(ui->xdpy, ui->xwin_root, RRScreenChangeNotifyMask);
+}
+
+static boolean
+xrandr_process_xevent(MBKeyboardUI *ui, XEvent *xev)
+{
+  if (!ui->have_xrandr)
+    return False;
+
+  if (xev->type == ui->xrandr_event_base + RRScreenChangeNotify)
+    {
+      XRRScreenChangeNotifyEvent *sce = (XRRScreenChangeNotifyEvent *)xev;
+
+      /* Keeps Xlib's idea of the screen ( DisplayWidth() etc ) right */
+      XRRUpdateConfiguration(xev);
+
+      if (sce->rotation & (RR_Rotate_90|RR_Rotate_270))
+	set_display_size(ui, sce->height, sce->width);
+      else
+	set_display_size(ui, sce->width, sce->height);
+
+      return True;
+    }
+
+  if (xev->type == ui->xrandr_event_base + RRNotify
+      && ((XRRNotifyEvent *)xev)->subtype == RRNotify_CrtcChange)
+    {
+      XRRCrtcChangeNotifyEvent *cce = (XRRCrtcChangeNotifyEvent *)xev;
+      int                       i;
+
+      for (i = 0; i < ui->n_crtcs; i++)
+	if (ui->crtcs[i] == cce->crtc)
+	  {
+	    ui->crtc_rects[i].x      = cce->x;
+	    ui->crtc_rects[i].y      = cce->y;
+	    ui->crtc_rects[i].width  = (cce->mode != None) ? cce->width : 0;
+	    ui->crtc_rects[i].height = (cce->mode != None) ? cce->height : 0;
+
+	    xrandr_update_crtc(ui);
+	    break;
+	  }
+
+      return True;
+    }
+
+  return False;
+}
+
+#endif
+
 static boolean
 want_extended(MBKeyboardUI *ui)
 {
@@ -193,38 +408,118 @@ want_extended(MBKeyboardUI *ui)
   return False;
 }
 
+/* 
+ * Next event, or False if none came within tv ( forever if its zero ),
+ * tv being left with whatever time remains like linux select() does.
+ * Layout files changing, a queued resize coming due and signals are
+ * dealt with meanwhile, see config-watch.c, mb_kbd_ui_queue_configure()
+ * and mb_kbd_signals_init().
+*/
 static boolean
-get_xevent_timed(Display        *dpy,
+get_xevent_timed(MBKeyboardUI   *ui,
 		 XEvent         *event_return, 
 		 struct timeval *tv)
 {
-  if (tv->tv_usec == 0 && tv->tv_sec == 0)
-    {
-      XNextEvent(dpy, event_return);
-      return True;
-    }
+  Display   *dpy       = ui->xdpy;
+  int        watch_fd  = mb_kbd_config_watch_fd(ui->kbd->config_watch);
+  int        signal_fd = mb_kbd_signals_fd();
+  boolean    forever   = (tv->tv_usec == 0 && tv->tv_sec == 0);
+  long long  end = 0, left;
+
+  /* Always select(), XNextEvent() would sit out a quit signal */
+  if (!forever)
+    end = util_monotonic_usec() + tv->tv_sec * 1000000LL + tv->tv_usec;
 
   XFlush(dpy);
 
-  if (XPending(dpy) == 0) 
+  while (XPending(dpy) == 0) 
     {
-      int fd = ConnectionNumber(dpy);
+      struct timeval  wait, *waitp = NULL;
+      long long       now = util_monotonic_usec();
+      int             fd = ConnectionNumber(dpy), max_fd;
+      int             rc;
 
       fd_set readset;
       FD_ZERO(&readset);
       FD_SET(fd, &readset);
 
-      if (select(fd+1, &readset, NULL, NULL, tv) == 0) 
-	return False;
-      else 
+      if (watch_fd >= 0)
+	FD_SET(watch_fd, &readset);
+
+      if (signal_fd >= 0)
+	FD_SET(signal_fd, &readset);
+
+      max_fd = (fd > watch_fd) ? fd : watch_fd;
+      if (signal_fd > max_fd)
+	max_fd = signal_fd;
+
+      /* Whichever is first, our timeout or the resize */
+      left = forever ? -1 : (end > now ? end - now : 0);
+
+      if (ui->configure_pending)
 	{
-	  XNextEvent(dpy, event_return);
-	  return True;
+	  long long due = ui->configure_deadline - now;
+
+	  if (due < 0)
+	    due = 0;
+
+	  if (left < 0 || due < left)
+	    left = due;
 	}
-    } else {
-      XNextEvent(dpy, event_return);
-      return True;
+
+      if (left >= 0)
+	{
+	  wait.tv_sec  = left / 1000000;
+	  wait.tv_usec = left % 1000000;
+	  waitp        = &wait;
+	}
+
+      rc = select(max_fd + 1, &readset, NULL, NULL, waitp);
+
+      /* Signals ( latency dumps ) shouldnt look like a timeout */
+      if ((rc < 0 && errno == EINTR)
+	  || (rc > 0 && signal_fd >= 0 && FD_ISSET(signal_fd, &readset)))
+	{
+	  mb_kbd_signals_process();
+	  continue;
+	}
+
+      if (rc == 0) 
+	{
+	  if (!forever && util_monotonic_usec() >= end)
+	    {
+	      tv->tv_sec = tv->tv_usec = 0;
+	      return False;
+	    }
+
+	  /* The resize settled, which may well have drawn */
+	  mb_kbd_ui_configure_idle(ui);
+	  XFlush(dpy);
+	  continue;
+	}
+
+      if (rc < 0 || FD_ISSET(fd, &readset))
+	break;
+
+      /* Only the watch, which may well have drawn */
+      mb_kbd_config_watch_dispatch(ui->kbd);
+      XFlush(dpy);
+    }
+
+  if (!forever)
+    {
+      /* Never all the way to zero, that would mean forever */
+      left = end - util_monotonic_usec();
+
+      if (left < 1)
+	left = 1;
+
+      tv->tv_sec  = left / 1000000;
+      tv->tv_usec = left % 1000000;
     }
+
+  XNextEvent(dpy, event_return);
+  return True;
 }
 
 
@@ -234,7 +529,20 @@ mb_kbd_ui_send_press(MBKeyboardUI        *ui,
 		     int                  modifiers)
 {
   DBG("Sending '%s'", utf8_char_in);
-  fakekey_press(ui->fakekey, (unsigned char*)utf8_char_in, -1, modifiers);
+
+  /* Shortcuts still need to be keys */
+  if (ui->im_window != None && modifiers == 0)
+    {
+      unsigned int ucs4;
+      int          len;
+
+      if ((len = util_utf8_get_char(utf8_char_in, &ucs4)) > 0)
+	mb_kbd_inject_commit(ui->injector, ui->im_window, utf8_char_in, len);
+    }
+  else
+    mb_kbd_inject_press(ui->injector, utf8_char_in, modifiers);
+
+  mb_kbd_latency_record_since_event (MBKeyboardLatencyInputToInject);
 }
 
 void
@@ -242,13 +550,28 @@ mb_kbd_ui_send_keysym_press(MBKeyboardUI  *ui,
 			    KeySym         ks,
 			    int            modifiers)
 {
-  fakekey_press_keysym(ui->fakekey, ks, modifiers);
+  mb_kbd_inject_press_keysym(ui->injector, ks, modifiers);
+  mb_kbd_latency_record_since_event (MBKeyboardLatencyInputToInject);
+}
+
+void
+mb_kbd_ui_send_string(MBKeyboardUI  *ui,
+		      const char    *utf8_str,
+		      int            modifiers)
+{
+  DBG("Sending string '%s'", utf8_str);
+
+  if (ui->im_window != None && modifiers == 0)
+    mb_kbd_inject_commit(ui->injector, ui->im_window, utf8_str, -1);
+  else
+    mb_kbd_inject_string(ui->injector, utf8_str, modifiers);
+  mb_kbd_latency_record_since_event (MBKeyboardLatencyInputToInject);
 }
 
 void
 mb_kbd_ui_send_release(MBKeyboardUI  *ui)
 {
-  fakekey_release(ui->fakekey);
+  mb_kbd_inject_release(ui->injector);
 }
 
 static void
@@ -376,31 +699,14 @@ mb_kbd_ui_min_key_size(MBKeyboardUI  *ui,
 static void
 mb_apply_win_prop(MBKeyboardUI *ui) // Xlab: anti-decorate flags
 {
-
-  Atom
-     atom_NET_WM_STATE_SKIP_PAGER,
-     atom_NET_WM_STATE_SKIP_TASKBAR,
-     atom_NET_WM_STATE,
-     atom_OB_WM_STATE_UNDECORATED; // Xlab: openbox support
-
-  atom_NET_WM_STATE_SKIP_TASKBAR =
-    XInternAtom(ui->xdpy, "_NET_WM_STATE_SKIP_TASKBAR", False);
-  
-  atom_OB_WM_STATE_UNDECORATED =
-    XInternAtom(ui->xdpy, "_OB_WM_STATE_UNDECORATED", False);
-
-  atom_NET_WM_STATE_SKIP_PAGER = 
-    XInternAtom(ui->xdpy, "_NET_WM_STATE_SKIP_PAGER", False);
-
-  atom_NET_WM_STATE =
-    XInternAtom(ui->xdpy, "_NET_WM_STATE", False);
-
-Atom states[] = { atom_NET_WM_STATE_SKIP_TASKBAR, atom_NET_WM_STATE_SKIP_PAGER, atom_OB_WM_STATE_UNDECORATED};
+  Atom states[] = { ui->atoms[MBKeyboardAtomNetWMStateSkipTaskbar], 
+		    ui->atoms[MBKeyboardAtomNetWMStateSkipPager], 
+		    ui->atoms[MBKeyboardAtomOBWMStateUndecorated] };
 	  
-	  XChangeProperty(ui->xdpy, ui->xwin, 
-			  atom_NET_WM_STATE, XA_ATOM, 32, 
-			  PropModeReplace, 
-			  (unsigned char *)states, 3);
+  XChangeProperty(ui->xdpy, ui->xwin, 
+		  ui->atoms[MBKeyboardAtomNetWMState], XA_ATOM, 32, 
+		  PropModeReplace, 
+		  (unsigned char *)states, 3);
 }
 
 
@@ -573,6 +879,13 @@ mb_kbd_ui_allocate_ui_layout(MBKeyboardUI *ui,
   *width = max_row_width;
 }
 
+/* A daemon not currently shown, kept ready to be */
+static Bool
+mb_kbd_ui_hidden(MBKeyboardUI *ui)
+{
+  return ui->is_daemon && !ui->visible && !mb_kbd_ui_embeded(ui);
+}
+
 void
 mb_kbd_ui_redraw_key(MBKeyboardUI  *ui, MBKeyboardKey *key)
 {
@@ -598,18 +911,21 @@ mb_kbd_ui_redraw_row(MBKeyboardUI  *ui, MBKeyboardRow *row)
 void
 mb_kbd_ui_swap_buffers(MBKeyboardUI  *ui)
 {
+  /* Nothing on screen to update, the map does it */
+  if (mb_kbd_ui_hidden(ui))
+    return;
+
   XClearWindow(ui->xdpy, ui->xwin);
   XSync(ui->xdpy, False);
 }
 
-void
-mb_kbd_ui_redraw(MBKeyboardUI  *ui)
+/* Draws the selected layout into the backbuffer */
+static void
+mb_kbd_ui_render(MBKeyboardUI  *ui)
 {
   List             *row_item;
   MBKeyboardLayout *layout;
 
-  MARK();
-
   /* gives backend a chance to clear everything */
   ui->backend->pre_redraw(ui);
 
@@ -625,13 +941,84 @@ mb_kbd_ui_redraw(MBKeyboardUI  *ui)
 
       row_item = util_list_next(row_item);
     }
+
+  ui->frame_stale = False;
+}
+
+/*
+ * A hidden daemon only notes the frame needs redrawing, its done in
+ * idle time ( see mb_kbd_ui_hidden_idle() ) so a burst of changes costs
+ * one render and a show finds the backbuffer current.
+*/
+void
+mb_kbd_ui_redraw(MBKeyboardUI  *ui)
+{
+  long long         start;
+
+  MARK();
+
+  if (mb_kbd_ui_hidden(ui))
+    {
+      ui->frame_stale = True;
+      return;
+    }
+
+  start = mb_kbd_latency_begin();
+
+  mb_kbd_ui_render(ui);
   
   mb_kbd_ui_swap_buffers(ui);
+
+  mb_kbd_latency_end (MBKeyboardLatencyRedraw, start);
 }
 
+/*
+ * The selected layout changed on a reload. If only the keys given did 
+ * they kept the geometry of those they replaced, so need just redrawing,
+ * unless they change the base key size everything else is sized from.
+*/
+void
+mb_kbd_ui_handle_layout_change(MBKeyboardUI *ui, 
+			       boolean       relayout, 
+			       List         *keys)
+{
+  int   key_uwidth, key_uheight;
+  List *key_item;
+
+  if (!relayout)
+    {
+      if (keys == NULL)
+	return;
+
+      mb_kdb_ui_unit_key_size(ui, &key_uwidth, &key_uheight);
+
+      relayout = (key_uwidth != ui->key_uwidth 
+		  || key_uheight != ui->key_uheight);
+    }
+
+  if (relayout)
+    {
+      mb_kbd_ui_handle_reconfigure(ui);
+      mb_kbd_ui_redraw(ui);
+      return;
+    }
+
+  for (key_item = util_list_get_first(keys); key_item; key_item = key_item->next)
+    mb_kbd_ui_redraw_key(ui, key_item->data);
+
+  mb_kbd_ui_swap_buffers(ui);
+}
+
+/*
+ * The backbuffer is the window background so mapping is all it takes,
+ * the server paints it. No round trip, the frame is normally current
+ * already ( see mb_kbd_ui_hidden_idle() ).
+*/
 void
 mb_kbd_ui_show(MBKeyboardUI  *ui)
 {
+  long long start;
+
   if (ui->visible)
     return;
 
@@ -639,24 +1026,45 @@ mb_kbd_ui_show(MBKeyboardUI  *ui)
       && ui->dpy_orientation != ui->valid_orientation)
     return;
 
+  if (ui->waiting_for_wm)
+    {
+      /* Mapped by mb_kbd_ui_check_wm_ready() once the WM is up */
+      ui->show_pending = True;
+      return;
+    }
+
+  start = mb_kbd_latency_begin();
+
+  if (ui->frame_stale)
+    mb_kbd_ui_render(ui);
+
+  if (ui->win_prop_stale)
+    {
+      mb_apply_win_prop(ui); // Xlab: apply window flags
+      ui->win_prop_stale = False;
+    }
 
-  mb_apply_win_prop(ui); // Xlab: apply window flags
   XMapWindow(ui->xdpy, ui->xwin);
-  mb_kbd_ui_redraw (ui);
+  XFlush(ui->xdpy);
 
   ui->visible = True;
 
-
+  mb_kbd_latency_end (MBKeyboardLatencyShow, start);
 }
 
 void
 mb_kbd_ui_hide(MBKeyboardUI  *ui)
 {
+  ui->show_pending = False;
+
   if (!ui->visible)
     return;
 
   XUnmapWindow(ui->xdpy, ui->xwin);
 
+  /* Nothing should stay held down with us gone */
+  mb_kbd_inject_release_modifiers(ui->injector);
+
   ui->visible = False;
 }
 
@@ -689,6 +1097,112 @@ mb_kbd_ui_set_invert (MBKeyboardUI *ui, int invert)
   ui->invert = invert;
 }
 			  
+/* 
+ * Hints only an EWMH window manager cares about. Done at creation time
+ * or, for a daemon started before the WM, once the WM shows up.
+*/
+static void
+mb_kbd_ui_set_ewmh_hints(MBKeyboardUI *ui, boolean have_matchbox_wm)
+{
+  /* XXX Fix this for display size */
+  int wm_struct_vals[] = { 0, /* left */		// Xlab: variants of docking
+			   0, /* right */ 
+			   0, /* top */
+			   0, /* bottom */
+			   0, /* left_start_y */
+			   0, /* left_end_y */
+			   0, /* right_start_y */
+			   0, /* right_end_y */
+			   0, /* top_start_x */
+			   0, /* top_end_x */
+			   0, /* bottom_start_x */
+			   0}; /* bottom_end_x */
+
+  int  desk_width = 0, desk_height = 0, desk_y = 0;
+  int  crtc_x = 0, crtc_y = 0, crtc_width = 0, crtc_height = 0;
+  Bool have_crtc;
+
+  mb_apply_win_prop(ui);
+
+#if HAVE_XRANDR
+  xrandr_update_crtc(ui);
+#endif
+
+  /* With more than one monitor the work area spans them all */
+  have_crtc = mb_kbd_ui_display_crtc_geometry(ui, &crtc_x, &crtc_y, 
+					      &crtc_width, &crtc_height);
+
+  if (get_desktop_area(ui, NULL, &desk_y, &desk_width, &desk_height))
+    {
+      if (have_crtc && crtc_width < desk_width)
+	desk_width = crtc_width;
+
+      /* Assuming we take up all available display width 
+       * ( at least true with matchbox wm ). we resize
+       * the base ui width to this ( and height as a factor ) 
+       * to avoid the case of mapping and then the wm resizing
+       * us, causing an ugly repaint. 
+       */
+      if (desk_width > ui->xwin_width)
+	{
+	  // Adjust the height of the keyboard to be some percent of the screen
+	  // if a valid value for that override was given.
+	  int iMyHeight = ( desk_width * ui->xwin_height ) / ui->xwin_width;
+
+	  if (ui->height_percent > 0 && ui->height_percent <= 100)
+	    iMyHeight = desk_height * (ui->height_percent / 100.0f);
+
+	  mb_kbd_ui_resize(ui, desk_width,  iMyHeight);
+	}
+
+      if (ui->imyh != 0)
+	wm_struct_vals[3] = ui->imyh; // Xlab: WHOAAA!!!
+      else
+	wm_struct_vals[3] = 160;
+
+      if (ui->invert)
+	wm_struct_vals[3] += (ui->dpy_height - desk_height);
+
+      if (have_crtc)
+	{
+	  /* Struts are from the screen edge, and only span our monitor */
+	  wm_struct_vals[3]  += ui->dpy_height - (crtc_y + crtc_height);
+	  wm_struct_vals[10]  = crtc_x;
+	  wm_struct_vals[11]  = crtc_x + crtc_width - 1;
+	}
+      else
+	wm_struct_vals[11] = desk_width;
+
+      XChangeProperty(ui->xdpy, ui->xwin, 
+		      ui->atoms[MBKeyboardAtomNetWMStrutPartial], 
+		      XA_CARDINAL, 32, 
+		      PropModeReplace, 
+		      (unsigned char *)wm_struct_vals , 12);
+
+      DBG("desk width: %i, desk height: %i xwin_height :%i",
+	  desk_width, desk_height, ui->xwin_height);
+    }
+
+  if (have_matchbox_wm)
+    {
+      /*
+      XChangeProperty(ui->xdpy, ui->xwin, 
+		      ui->atoms[MBKeyboardAtomNetWMWindowType], XA_ATOM, 32, 
+		      PropModeReplace, 
+		      (unsigned char *) &ui->atoms[MBKeyboardAtomNetWMWindowTypeToolbar], 1);
+      */
+    }
+  else
+    {
+      /*
+      XChangeProperty(ui->xdpy, ui->xwin, 
+		      ui->atoms[MBKeyboardAtomNetWMWindowType], XA_ATOM, 32, 
+		      PropModeReplace, 
+		      (unsigned char *) &ui->atoms[MBKeyboardAtomNetWMWindowTypeDock], 1);
+      */
+    }
+}
+
 static int
 mb_kbd_ui_resources_create(MBKeyboardUI  *ui)
 {
@@ -707,18 +1221,6 @@ mb_kbd_ui_resources_create(MBKeyboardUI  *ui)
   } PropMotifWmHints ;
 
 
-  Atom /* atom_wm_protocols[3], */ 
-     atom_NET_WM_WINDOW_TYPE, 
-     atom_NET_WM_WINDOW_TYPE_TOOLBAR,
-     atom_NET_WM_WINDOW_TYPE_DOCK,
-     atom_NET_WM_STRUT_PARTIAL,
-     atom_NET_WM_STATE_SKIP_PAGER,
-     atom_NET_WM_STATE_SKIP_TASKBAR,
-     atom_NET_WM_STATE,
-     atom_MOTIF_WM_HINTS,
-     atom_OB_WM_STATE_UNDECORATED;
-  
-
   PropMotifWmHints    *mwm_hints;
   XSizeHints           size_hints;
   XWMHints            *wm_hints;
@@ -731,39 +1233,10 @@ mb_kbd_ui_resources_create(MBKeyboardUI  *ui)
   boolean              have_matchbox_wm = False;             
   boolean              have_ewmh_wm     = False;             
 
-  /*
-  atom_wm_protocols = { 
-    XInternAtom(ui->xdpy, "WM_DELETE_WINDOW",False),
-    XInternAtom(ui->xdpy, "WM_PROTOCOLS",False),
-    XInternAtom(ui->xdpy, "WM_NORMAL_HINTS", False),
-  };
-  */
-  atom_NET_WM_WINDOW_TYPE =
-    XInternAtom(ui->xdpy, "_NET_WM_WINDOW_TYPE" , False);
-
-  atom_NET_WM_WINDOW_TYPE_TOOLBAR =
-    XInternAtom(ui->xdpy, "_NET_WM_WINDOW_TYPE_TOOLBAR", False);
-
-  atom_NET_WM_WINDOW_TYPE_DOCK = 
-    XInternAtom(ui->xdpy, "_NET_WM_WINDOW_TYPE_DOCK", False);
-
-  atom_MOTIF_WM_HINTS =
-    XInternAtom(ui->xdpy, "_MOTIF_WM_HINTS", False);
-
-  atom_NET_WM_STRUT_PARTIAL = 
-    XInternAtom(ui->xdpy, "_NET_WM_STRUT_PARTIAL", False);
-
-  atom_NET_WM_STATE_SKIP_TASKBAR =
-    XInternAtom(ui->xdpy, "_NET_WM_STATE_SKIP_TASKBAR", False);
-  
-  atom_OB_WM_STATE_UNDECORATED =
-    XInternAtom(ui->xdpy, "_OB_WM_STATE_UNDECORATED", False);
-
-  atom_NET_WM_STATE_SKIP_PAGER = 
-    XInternAtom(ui->xdpy, "_NET_WM_STATE_SKIP_PAGER", False);
-
-  atom_NET_WM_STATE =
-    XInternAtom(ui->xdpy, "_NET_WM_STATE", False);
+  /* Selected before looking for the WM so we cant miss it appearing */
+  XSelectInput (ui->xdpy,  ui->xwin_root, 
+		SubstructureNotifyMask|StructureNotifyMask
+		|(ui->is_daemon ? PropertyChangeMask : 0));
 
   if ((wm_name = get_current_window_manager_name(ui)) != NULL)
     {
@@ -774,24 +1247,27 @@ mb_kbd_ui_resources_create(MBKeyboardUI  *ui)
     {
       if (ui->is_daemon)
 	{
-	  /* Hack to avoid starting before the WM. Needed only in daemon mode
+	  /* Started before the WM. Rather than blocking, carry on and
+	   * finish setting up once _NET_SUPPORTING_WM_CHECK appears
+	   * ( see mb_kbd_ui_check_wm_ready ). Needed only in daemon mode.
 	  */
-	  while (wm_name == NULL)
-	    {
-	      sleep(1);
-	      wm_name = get_current_window_manager_name(ui);
-	    }
-
-	  have_ewmh_wm = True;
+	  DBG("no window manager yet, waiting on root PropertyNotify");
+	  ui->waiting_for_wm = True;
 	}
     }
 
   if (wm_name && streq(wm_name, "matchbox"))
     have_matchbox_wm = True;
 
+  if (wm_name)
+    free(wm_name);
+
+  mb_kbd_startup_mark (MBKeyboardStartupWMCheck);
+
   win_attr.override_redirect = ui->override; /* отвязка */
   win_attr.event_mask 
-    = ButtonPressMask|ButtonReleaseMask|Button1MotionMask|StructureNotifyMask;
+    = ButtonPressMask|ButtonReleaseMask|Button1MotionMask|StructureNotifyMask
+    |(ui->is_daemon ? PropertyChangeMask : 0);
 
   int  desk_height = 0,desk_y=0;
   get_desktop_area(ui, NULL, &desk_y, NULL, &desk_height);
@@ -818,6 +1294,9 @@ if(ui->invert)
 
 
 
+ui->xwin_x = ui->x_shift;
+ui->xwin_y = (ui->y_shift!=0)?ui->y_shift:shift;
+
 ui->xwin = XCreateWindow(ui->xdpy,
       ui->xwin_root,
       ui->x_shift,(ui->y_shift!=0)?ui->y_shift:shift,  // Xlab shift's fix
@@ -827,9 +1306,6 @@ ui->xwin = XCreateWindow(ui->xdpy,
       CWOverrideRedirect|CWEventMask,
       &win_attr);
 
-  XSelectInput (ui->xdpy,  ui->xwin_root, 
-		SubstructureNotifyMask|StructureNotifyMask);
-
   wm_hints = XAllocWMHints();
   
   if (wm_hints)
@@ -875,7 +1351,8 @@ ui->xwin = XCreateWindow(ui->xdpy,
 	  mwm_hints->flags = MWM_HINTS_DECORATIONS;
 	  mwm_hints->decorations = 0;
 	  
-	  XChangeProperty(ui->xdpy, ui->xwin, atom_MOTIF_WM_HINTS, 
+	  XChangeProperty(ui->xdpy, ui->xwin, 
+			  ui->atoms[MBKeyboardAtomMotifWMHints], 
 			  XA_ATOM, 32, PropModeReplace, 
 			  (unsigned char *)mwm_hints, 
 			  PROP_MOTIF_WM_HINTS_ELEMENTS);
@@ -884,91 +1361,7 @@ ui->xwin = XCreateWindow(ui->xdpy,
 	}
       
       if (have_ewmh_wm)
-	{
-	  /* XXX Fix this for display size */
-	  int wm_struct_vals[] = { 0, /* left */		// Xlab: variants of docking
-				   0, /* right */ 
-				   0, /* top */
-				   0, /* bottom */
-				   0, /* left_start_y */
-				   0, /* left_end_y */
-				   0, /* right_start_y */
-				   0, /* right_end_y */
-				   0, /* top_start_x */
-				   0, /* top_end_x */
-				   0, /* bottom_start_x */
-				   0}; /* bottom_end_x */
-	  
-	  Atom states[] = { atom_NET_WM_STATE_SKIP_TASKBAR, atom_NET_WM_STATE_SKIP_PAGER, atom_OB_WM_STATE_UNDECORATED};
-	  int  desk_width = 0, desk_height = 0, desk_y = 0;
-	  
-	  XChangeProperty(ui->xdpy, ui->xwin, 
-			  atom_NET_WM_STATE, XA_ATOM, 32, 
-			  PropModeReplace, 
-			  (unsigned char *)states, 3);
-	  
-	  if (get_desktop_area(ui, NULL, &desk_y, &desk_width, &desk_height))
-	    {
-	      /* Assuming we take up all available display width 
-	       * ( at least true with matchbox wm ). we resize
-	       * the base ui width to this ( and height as a factor ) 
-	       * to avoid the case of mapping and then the wm resizing
-	       * us, causing an ugly repaint. 
-	       */
-	      if (desk_width > ui->xwin_width)
-		{
-			// Adjust the height of the keyboard to be some percent of the screen
-			// if a valid value for that override was given.
-			int iMyHeight = ( desk_width * ui->xwin_height ) / ui->xwin_width;
-			
-			if (ui->height_percent > 0 && ui->height_percent <= 100)
-			{
-				iMyHeight = desk_height * (ui->height_percent / 100.0f);
-			}
-			mb_kbd_ui_resize(ui, desk_width,  iMyHeight);
-			
-			
-		}
-	      if(ui->imyh!=0){
-	      wm_struct_vals[3]  = ui->imyh; // Xlab: WHOAAA!!!
-		}else{
-		wm_struct_vals[3]  = 160;
-		} 
-if(ui->invert)
-{
-wm_struct_vals[3]+=(ui->dpy_height-desk_height);
-}
-
-	      wm_struct_vals[11] = desk_width;
-	      
-	      XChangeProperty(ui->xdpy, ui->xwin, 
-			      atom_NET_WM_STRUT_PARTIAL, XA_CARDINAL, 32, 
-			      PropModeReplace, 
-			      (unsigned char *)wm_struct_vals , 12);
-
-	      DBG("desk width: %i, desk height: %i xwin_height :%i",
-		  desk_width, desk_height, ui->xwin_height);
-	      
-	    }
-	  
-	  if (have_matchbox_wm)
-	    {/*
-	      XChangeProperty(ui->xdpy, ui->xwin, 
-			      atom_NET_WM_WINDOW_TYPE, XA_ATOM, 32, 
-			      PropModeReplace, 
-			      (unsigned char *) &atom_NET_WM_WINDOW_TYPE_TOOLBAR, 1);
-	    */}
-	  else
-	    {
-	      /*
-		XChangeProperty(ui->xdpy, ui->xwin, 
-		atom_NET_WM_WINDOW_TYPE, XA_ATOM, 32, 
-		PropModeReplace, 
-		(unsigned char *) &atom_NET_WM_WINDOW_TYPE_DOCK, 1);
-	      */
-	      
-	    }
-	}
+	mb_kbd_ui_set_ewmh_hints(ui, have_matchbox_wm);
     }
 
   ui->backbuffer = XCreatePixmap(ui->xdpy,
@@ -982,8 +1375,13 @@ wm_struct_vals[3]+=(ui->dpy_height-desk_height);
 			     ui->xwin, 
 			     ui->backbuffer);
 
+  /* Nothing drawn yet, _NET_WM_STATE set again before first show */
+  ui->frame_stale    = True;
+  ui->win_prop_stale = True;
+
   ui->backend->resources_create(ui);
 
+  mb_kbd_startup_mark (MBKeyboardStartupWindowCreate);
 
   /* Get root size change events for rotation */
 
@@ -993,6 +1391,73 @@ wm_struct_vals[3]+=(ui->dpy_height-desk_height);
 }
 
 
+/* 
+ * Called on root ( or WM check window ) property changes while a daemon
+ * is waiting for the window manager. Finishes the WM dependant setup
+ * and performs any show that was requested in the meantime.
+*/
+static void
+mb_kbd_ui_check_wm_ready(MBKeyboardUI *ui)
+{
+  char   *wm_name;
+  Window  check_xwin;
+
+  if (!ui->waiting_for_wm)
+    return;
+
+  if ((wm_name = get_current_window_manager_name(ui)) == NULL)
+    {
+      /* The check window can be set before the WM names it, so watch
+       * it for _NET_WM_NAME too.
+      */
+      check_xwin = get_wm_check_window(ui);
+
+      if (check_xwin == None || check_xwin == ui->wm_check_xwin)
+	return;
+
+      util_trap_x_errors();
+      XSelectInput(ui->xdpy, check_xwin, PropertyChangeMask);
+      XSync(ui->xdpy, False);
+
+      if (util_untrap_x_errors())
+	return;
+
+      ui->wm_check_xwin = check_xwin;
+
+      /* It may have been named before we selected for it */
+      if ((wm_name = get_current_window_manager_name(ui)) == NULL)
+	return;
+    }
+
+  DBG("window manager '%s' is up", wm_name);
+
+  ui->waiting_for_wm = False;
+
+  XSelectInput (ui->xdpy,  ui->xwin_root, 
+		SubstructureNotifyMask|StructureNotifyMask);
+
+  if (ui->wm_check_xwin != None)
+    {
+      util_trap_x_errors();
+      XSelectInput(ui->xdpy, ui->wm_check_xwin, NoEventMask);
+      XSync(ui->xdpy, False);
+      util_untrap_x_errors();
+
+      ui->wm_check_xwin = None;
+    }
+
+  unless (ui->want_embedding)
+    mb_kbd_ui_set_ewmh_hints(ui, streq(wm_name, "matchbox"));
+
+  free(wm_name);
+
+  if (ui->show_pending)
+    {
+      ui->show_pending = False;
+      mb_kbd_ui_show(ui);
+    }
+}
+
 static void
 mb_kbd_ui_resize(MBKeyboardUI *ui, int width, int height) 
 {
@@ -1232,9 +1697,7 @@ mb_kbd_ui_handle_configure(MBKeyboardUI *ui,
 
   MARK();
 
-  /* Figure out if screen size has changed - does a round trip - bad */
-
-  update_display_size(ui);
+  /* Screen size is already current, see set_display_size() */
 
   old_state = mb_kbd_is_extended(ui->kbd);
   new_state = want_extended(ui);
@@ -1257,6 +1720,98 @@ mb_kbd_ui_handle_configure(MBKeyboardUI *ui,
 
 }
 
+/* 
+ * A WM settling our size on map, or a drag resize, sends a stream of
+ * ConfigureNotifys. Each relayout means a font reload, a new backbuffer
+ * and a full redraw so only the size the window settles on is acted on,
+ * once nothing is left to read and it has not changed for a moment. Till
+ * then the server keeps tiling the old backbuffer, our window background,
+ * into any exposed area so there is always something stale on screen.
+*/
+#define CONFIGURE_IDLE_USEC (30 * 1000)
+
+static void
+mb_kbd_ui_queue_configure(MBKeyboardUI *ui,
+			  int           width,
+			  int           height)
+{
+  if (width == ui->xwin_width && height == ui->xwin_height)
+    {
+      /* Back where we were */
+      ui->configure_pending = False;
+      return;
+    }
+
+  /* Just a move, dont push the deadline back */
+  if (ui->configure_pending 
+      && width == ui->configure_width && height == ui->configure_height)
+    return;
+
+  ui->configure_width    = width;
+  ui->configure_height   = height;
+  ui->configure_deadline = util_monotonic_usec() + CONFIGURE_IDLE_USEC;
+  ui->configure_pending  = True;
+
+  DBG("queued resize to %ix%i", width, height);
+}
+
+/* 
+ * A resize whose deadline has passed, once nothing is left to read. The
+ * wait for it is part of get_xevent_timed()'s, so never blocks here.
+*/
+static void
+mb_kbd_ui_configure_idle(MBKeyboardUI *ui)
+{
+  if (!ui->configure_pending
+      || util_monotonic_usec() < ui->configure_deadline)
+    return;
+
+  XFlush(ui->xdpy);
+
+  if (XPending(ui->xdpy))
+    return;
+
+  ui->configure_pending = False;
+
+  mb_kbd_ui_handle_configure(ui, ui->configure_width, ui->configure_height);
+}
+
+/* 
+ * Keeps a hidden daemon ready to show, once there is nothing else to
+ * do: the frame redrawn after any change and our window state put back
+ * if the WM took it away on unmap ( as EWMH has it ).
+*/
+static void
+mb_kbd_ui_hidden_idle(MBKeyboardUI *ui)
+{
+  if (!mb_kbd_ui_hidden(ui) 
+      || (!ui->frame_stale && !ui->win_prop_stale)
+      || ui->configure_pending)	/* about to be redrawn anyway */
+    return;
+
+  XFlush(ui->xdpy);
+
+  if (XPending(ui->xdpy))
+    return;
+
+  if (ui->win_prop_stale)
+    {
+      mb_apply_win_prop(ui);
+      ui->win_prop_stale = False;
+    }
+
+  if (ui->frame_stale)
+    {
+      long long start = mb_kbd_latency_begin();
+
+      mb_kbd_ui_render(ui);
+
+      mb_kbd_latency_end (MBKeyboardLatencyRedraw, start);
+    }
+
+  XFlush(ui->xdpy);
+}
+
 /*!
  * Reconfigure the layout based on the current layout and current
  * width and height.
@@ -1288,15 +1843,28 @@ mb_kbd_ui_event_loop(MBKeyboardUI *ui)
 
 	while (True)
 	{
-	XEvent xev;
+	XEvent    xev;
+	long long start;
+
+	mb_kbd_signals_process();
+
+	mb_kbd_ui_configure_idle(ui);
 
-	if (get_xevent_timed(ui->xdpy, &xev, &tvt))
+	/* A layout reload put off while a key was held */
+	mb_kbd_config_watch_idle(ui->kbd);
+
+	mb_kbd_ui_hidden_idle(ui);
+
+	if (get_xevent_timed(ui, &xev, &tvt))
 	{			
+		start = mb_kbd_latency_begin();
 		  
 		switch (xev.type) 
 		{
 			case ButtonPress:
 			{
+				mb_kbd_latency_set_event_time (xev.xbutton.time);
+
 				press_x = xev.xbutton.x; 
 				press_y = xev.xbutton.y;
 				
@@ -1314,6 +1882,12 @@ mb_kbd_ui_event_loop(MBKeyboardUI *ui)
 					}
 
 					mb_kbd_key_press(key);
+
+					/* Only presented once the server has the paint */
+					if (mb_kbd_latency_enabled())
+						XSync(ui->xdpy, False);
+
+					mb_kbd_latency_record_since_event (MBKeyboardLatencyInputToPresent);
 				}
 	      
 				break;
@@ -1338,25 +1912,27 @@ mb_kbd_ui_event_loop(MBKeyboardUI *ui)
 		  
 case ButtonRelease:
 {	
+	mb_kbd_latency_set_event_time (xev.xbutton.time);
+
 	if(ui->gest==True)
 	{
 		if ( (press_x - xev.xbutton.x - 20) > ui->key_uwidth )
 		{
 			mb_kbd_key_release_send(ui->kbd, 0);			
-			fakekey_press_keysym(ui->fakekey, XK_BackSpace, 0);
-			fakekey_release(ui->fakekey);
+			mb_kbd_ui_send_keysym_press(ui, XK_BackSpace, 0);
+			mb_kbd_ui_send_release(ui);
 		}
 		else if ( (xev.xbutton.x - press_x - 30) > ui->key_uwidth )
 		{
 			mb_kbd_key_release_send(ui->kbd, 0);			
-			fakekey_press_keysym(ui->fakekey, XK_space, 0);
-			fakekey_release(ui->fakekey);			
+			mb_kbd_ui_send_keysym_press(ui, XK_space, 0);
+			mb_kbd_ui_send_release(ui);			
 		}
 		else if ( (xev.xbutton.y - press_y - 20) > ui->key_uheight )
 		{	
 			mb_kbd_key_release_send(ui->kbd, 0);
-			fakekey_press_keysym(ui->fakekey, XK_KP_Enter, 0);
-			fakekey_release(ui->fakekey);
+			mb_kbd_ui_send_keysym_press(ui, XK_KP_Enter, 0);
+			mb_kbd_ui_send_release(ui);
 		}
 		else if ( (press_y - xev.xbutton.y - 20) > ui->key_uheight )
 		{
@@ -1386,24 +1962,58 @@ break;
 }
 			  
 			case ConfigureNotify:
+				if (xev.xconfigure.window == ui->xwin_root)		    
+				{
+#if HAVE_XRANDR
+				    if (ui->have_xrandr)
+				      XRRUpdateConfiguration(&xev);
+#endif
+				    set_display_size(ui, xev.xconfigure.width, xev.xconfigure.height);
+				}
 				if (xev.xconfigure.window == ui->xwin 
-					&&  (xev.xconfigure.width != ui->xwin_width
-					|| xev.xconfigure.height != ui->xwin_height))
+				    && (xev.xconfigure.send_event || ui->override))
 				{
-					mb_kbd_ui_handle_configure(ui, xev.xconfigure.width, xev.xconfigure.height);
+					/* Only these are root relative, see ICCCM 4.1.5 */
+					ui->xwin_x = xev.xconfigure.x;
+					ui->xwin_y = xev.xconfigure.y;
 				}
-				if (xev.xconfigure.window == ui->xwin_root)		    
+				if (xev.xconfigure.window == ui->xwin)
 				{
-				    update_display_size(ui);
+					mb_kbd_ui_queue_configure(ui, xev.xconfigure.width, xev.xconfigure.height);
 				}
+#if HAVE_XRANDR
+				if (xev.xconfigure.window == ui->xwin)
+				    xrandr_update_crtc(ui);
+#endif
 				break;
 				
+			case PropertyNotify:
+				if (xev.xproperty.window == ui->xwin
+				    && xev.xproperty.atom == ui->atoms[MBKeyboardAtomNetWMState]
+				    && xev.xproperty.state == PropertyDelete)
+				{
+					ui->win_prop_stale = True;
+				}
+				if (ui->waiting_for_wm
+				    && ((xev.xproperty.window == ui->xwin_root
+					 && xev.xproperty.atom == ui->atoms[MBKeyboardAtomNetSupportingWMCheck])
+					|| (xev.xproperty.window == ui->wm_check_xwin
+					    && xev.xproperty.atom == ui->atoms[MBKeyboardAtomNetWMName])))
+				{
+					mb_kbd_ui_check_wm_ready(ui);
+				}
+				break;
+
 			case MappingNotify: 
-				fakekey_reload_keysyms(ui->fakekey);
-				XRefreshKeyboardMapping(&xev.xmapping);
+				/* Nothing on this connection uses the keymap, the 
+				 * injector tracks it on its own one. 
+				*/
 				break;
 
 			default:
+#if HAVE_XRANDR
+				xrandr_process_xevent(ui, &xev);
+#endif
 				break;
 	      }
 	      
@@ -1443,9 +2053,14 @@ break;
           break;
         }
       }
+
+	    mb_kbd_latency_end (MBKeyboardLatencyEvent, start);
           }
 	else
 	  {
+      /* Nothing from the server drives what happens below */
+      mb_kbd_latency_set_event_time (CurrentTime);
+
       /* Hide timed out */
       if (to_hide)
       {
@@ -1498,6 +2113,32 @@ mb_kbd_ui_display_height(MBKeyboardUI *ui)
   return ui->dpy_height;
 }
 
+boolean
+mb_kbd_ui_display_crtc_geometry(MBKeyboardUI *ui, 
+				int          *x, 
+				int          *y, 
+				int          *width, 
+				int          *height)
+{
+#if HAVE_XRANDR
+  XRectangle *r;
+
+  if (ui->crtc_index < 0)
+    return False;
+
+  r = &ui->crtc_rects[ui->crtc_index];
+
+  if (x) *x           = r->x;
+  if (y) *y           = r->y;
+  if (width)  *width  = r->width;
+  if (height) *height = r->height;
+
+  return True;
+#else
+  return False;
+#endif
+}
+
 MBKeyboardUIBackend*
 mb_kbd_ui_backend(MBKeyboardUI *ui)
 {
@@ -1528,6 +2169,12 @@ mb_kbd_ui_x_win_root(MBKeyboardUI *ui)
   return ui->xwin_root;
 }
 
+Atom
+mb_kbd_ui_x_atom(MBKeyboardUI *ui, MBKeyboardAtomType atom)
+{
+  return ui->atoms[atom];
+}
+
 int
 mb_kbd_ui_x_win_height(MBKeyboardUI *ui)
 {
@@ -1562,6 +2209,8 @@ mb_kbd_ui_realize(MBKeyboardUI *ui)
   if (!mb_kbd_ui_load_font(ui))
     return 0;
 
+  mb_kbd_startup_mark (MBKeyboardStartupFontLoad);
+
   /* potrait or landscape */
   if (want_extended(ui))
     mb_kbd_set_extended(ui->kbd, True);
@@ -1571,6 +2220,8 @@ mb_kbd_ui_realize(MBKeyboardUI *ui)
   */
   mb_kbd_ui_allocate_ui_layout(ui, &ui->base_alloc_width, &ui->base_alloc_height);
 
+  mb_kbd_startup_mark (MBKeyboardStartupLayoutAlloc);
+
   ui->xwin_width  = ui->base_alloc_width;
   ui->xwin_height = ui->base_alloc_height;
 
@@ -1581,12 +2232,16 @@ mb_kbd_ui_realize(MBKeyboardUI *ui)
       if (ui->is_daemon)
 	{
 	  /* Dont map daemon to begin with */
-	  mb_kbd_remote_init (ui);
 	}
       else
 	{
 	  mb_kbd_ui_show(ui);
-	  mb_kbd_ui_redraw(ui);
+
+	  /* Only counts once the server has done it too */
+	  if (mb_kbd_startup_enabled())
+	    XSync(ui->xdpy, False);
+
+	  mb_kbd_startup_mark (MBKeyboardStartupFirstPaint);
 	}
     }
   else
@@ -1604,18 +2259,37 @@ mb_kbd_ui_init(MBKeyboard *kbd)
   
   ui->kbd = kbd;
 
+  /* The injector runs a thread with a display of its own */
+  XInitThreads();
+
   if ((ui->xdpy = XOpenDisplay(getenv("DISPLAY"))) == NULL)
     return 0;
 
-  if ((ui->fakekey = fakekey_init(ui->xdpy)) == NULL)
+  /* Every atom we use, in a single round trip */
+  XInternAtoms(ui->xdpy, AtomNames, N_MBKeyboardAtoms, False, ui->atoms);
+
+  mb_kbd_startup_mark (MBKeyboardStartupXConnect);
+
+  if ((ui->injector = mb_kbd_inject_new(ui)) == NULL)
     return 0;
 
+  mb_kbd_startup_mark (MBKeyboardStartupInjector);
+
   ui->xscreen   = DefaultScreen(ui->xdpy);
   ui->xwin_root = RootWindow(ui->xdpy, ui->xscreen);   
 
   ui->backend = MB_KBD_UI_BACKEND_INIT_FUNC(ui);
 
-  update_display_size(ui);
+  /* From the connection setup, no round trip */
+  set_display_size(ui, 
+		   DisplayWidth(ui->xdpy, ui->xscreen), 
+		   DisplayHeight(ui->xdpy, ui->xscreen));
+
+#if HAVE_XRANDR
+  xrandr_init(ui);
+#endif
+
+  mb_kbd_startup_mark (MBKeyboardStartupUIInit);
 
   return 1;
 }
@@ -1651,6 +2325,13 @@ mb_kbd_ui_set_daemon (MBKeyboardUI *ui, int value)
   ui->is_daemon = value;
 }
 
+void
+mb_kbd_ui_set_im_window (MBKeyboardUI *ui, Window win)
+{
+  DBG("IM window now 0x%lx", win);
+  ui->im_window = win;
+}
+
 void
 mb_kbd_ui_limit_orientation (MBKeyboardUI                *ui, 
 			     MBKeyboardDisplayOrientation orientation)
@@ -39,7 +39,6 @@
 #define XEMBED_UNREGISTER_ACCELERATOR   13
 #define XEMBED_ACTIVATE_ACCELERATOR     14
 
-static Atom Atom_XEMBED; /* FIXME: put array of atoms in UI struct  */
 static Window ParentEmbedderWin = None;
 
 static void
@@ -49,9 +48,7 @@ mb_kbd_xembed_set_win_info (MBKeyboardUI *ui, int flags)
 
    Atom atom_ATOM_XEMBED_INFO;
 
-   atom_ATOM_XEMBED_INFO 
-     = XInternAtom(mb_kbd_ui_x_display(ui), "_XEMBED_INFO", False);
-
+   atom_ATOM_XEMBED_INFO = mb_kbd_ui_x_atom(ui, MBKeyboardAtomXEmbedInfo);
 
    list[0] = MAX_SUPPORTED_XEMBED_VERSION;
    list[1] = flags;
@@ -76,7 +73,7 @@ mb_kbd_xembed_send_message (MBKeyboardUI *ui,
 
   ev.xclient.type = ClientMessage;
   ev.xclient.window = w;
-  ev.xclient.message_type = Atom_XEMBED;
+  ev.xclient.message_type = mb_kbd_ui_x_atom(ui, MBKeyboardAtomXEmbed);
   ev.xclient.format = 32;
   ev.xclient.data.l[0] = CurrentTime; /* FIXME: Is this correct */
   ev.xclient.data.l[1] = message;
@@ -98,9 +95,6 @@ mb_kbd_xembed_send_message (MBKeyboardUI *ui,
 void
 mb_kbd_xembed_init (MBKeyboardUI *ui)
 {
-  /* FIXME: Urg global  */
-  Atom_XEMBED = XInternAtom(mb_kbd_ui_x_display(ui), "_XEMBED", False);
-
   mb_kbd_xembed_set_win_info (ui, 0);
 }
 
@@ -114,7 +108,8 @@ mb_kbd_xembed_process_xevents (MBKeyboardUI *ui, XEvent *xevent)
       DBG("### got Mapped ###");
       break;
     case ClientMessage:
-      if (xevent->xclient.message_type == Atom_XEMBED)
+      if (xevent->xclient.message_type 
+	  == mb_kbd_ui_x_atom(ui, MBKeyboardAtomXEmbed))
 	{
 	  switch (xevent->xclient.data.l[1])
 	    {
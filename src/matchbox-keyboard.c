@@ -20,6 +20,12 @@
  */
 
 #include "matchbox-keyboard.h"
+#include <errno.h>
+#include <signal.h>
+
+static volatile sig_atomic_t DumpRequested = 0;
+static volatile sig_atomic_t QuitRequested = 0;
+static int                   SignalFds[2]  = { -1, -1 };
 
 static void
 mb_kbd_usage (char *progname)
@@ -29,6 +35,7 @@ mb_kbd_usage (char *progname)
 	  "   -xid,--xid            Print window ID to stdout ( for embedding )\n"
 	  "   -d,--daemon      Run in 'daemon' mode (for remote control)\n"
 	  "   -t, --gestures	Enable gestures\n"
+	  "   --profile-startup <file>	Time each startup phase, see MB_KBD_PROFILE_STARTUP\n"
 	  "------------------------- UI Tweaks & Positioning --------------------\n"
 	  "   -p,--key-padding <px>  Key padding\n"
 	  "   -c,--col-spacing <px>	Space between columns\n"
@@ -60,6 +67,10 @@ mb_kbd_new (int argc, char **argv)
   char *geometry = "";
   MBKeyboardDisplayOrientation orientation = MBKeyboardDisplayAny;
 
+  mb_kbd_startup_begin();
+  mb_kbd_latency_init();
+  mb_kbd_signals_init();
+
   kb = util_malloc0(sizeof(MBKeyboard));
 
   kb->key_border = 0;
@@ -136,6 +147,12 @@ if (streq ("-c", argv[i]) || streq ("--col-spacing", argv[i]))
 	  invert = True;
 	  continue;
 	}
+      if (streq ("--profile-startup", argv[i]))
+	{
+	  if (++i>=argc) mb_kbd_usage (argv[0]);
+	  mb_kbd_startup_set_output (argv[i]);
+	  continue;
+	}
 	 if (streq ("-g", argv[i]) || streq ("--geometry", argv[i])) 
 	{
 	  if (++i>=argc) mb_kbd_usage (argv[0]);
@@ -201,9 +218,15 @@ if (streq ("-c", argv[i]) || streq ("--col-spacing", argv[i]))
   if (!mb_kbd_config_load(kb, variant))
     return NULL;
 
+  mb_kbd_startup_mark (MBKeyboardStartupConfigLoad);
+
   kb->selected_layout 
     = (MBKeyboardLayout *)util_list_get_nth_data(kb->layouts, 0);
 
+  mb_kbd_config_realize_layout(kb, kb->selected_layout);
+
+  mb_kbd_startup_mark (MBKeyboardStartupLayoutBuild);
+
   if (want_embedding)
     mb_kbd_ui_set_embeded (kb->ui, True);
 
@@ -397,6 +420,9 @@ void mb_kbd_incr_layout(MBKeyboard *kb, int iIncr)
 	if (idx < 0) 		idx = max - 1;	
 	
 	kb->selected_layout = util_list_get_nth_data(kb->layouts, idx);
+
+	/* Layouts are only built once first needed */
+	mb_kbd_config_realize_layout(kb, kb->selected_layout);
 }
 
 /*!
@@ -412,6 +438,7 @@ void mb_kbd_set__layout(MBKeyboard *kb)
 	if (idx >= max) idx = 0;		// Constrain to number of profiles.
 	
 	kb->selected_layout = util_list_get_nth_data(kb->layouts, idx);
+	mb_kbd_config_realize_layout(kb, kb->selected_layout);
 }
 
 void
@@ -439,9 +466,93 @@ mb_kbd_is_extended(MBKeyboard *kb)
 }
 
 
+static void
+mb_kbd_signal_handler (int sig)
+{
+  int  saved_errno = errno;
+  char wake = 0;
+
+  if (sig == SIGUSR1)
+    DumpRequested = 1;
+  else
+    QuitRequested = 1;
+
+  /* 
+   * Whichever thread took it, the event loop's select() wakes. A full
+   * pipe means it is awake already.
+  */
+  if (write(SignalFds[1], &wake, 1) < 0)
+    errno = saved_errno;
+}
+
+/*
+ * A kill, ^C or a hangup leaves through exit() from the event loop,
+ * so atexit() handlers get to run. Most of all the injector's, which
+ * lets go of any modifier key it still holds on the server. SIGUSR1
+ * dumps the latency histograms when they are kept.
+*/
+void
+mb_kbd_signals_init (void)
+{
+  struct sigaction act;
+  int              i;
+
+  if (pipe(SignalFds) < 0)
+    {
+      perror("matchbox-keyboard: signal pipe");
+      SignalFds[0] = SignalFds[1] = -1;
+      return;
+    }
+
+  for (i = 0; i < 2; i++)
+    {
+      fcntl(SignalFds[i], F_SETFL, O_NONBLOCK);
+      fcntl(SignalFds[i], F_SETFD, FD_CLOEXEC);
+    }
+
+  memset(&act, 0, sizeof(act));
+  act.sa_handler = mb_kbd_signal_handler;
+  sigemptyset(&act.sa_mask);
+
+  sigaction(SIGTERM, &act, NULL);
+  sigaction(SIGINT, &act, NULL);
+  sigaction(SIGHUP, &act, NULL);
+
+  if (mb_kbd_latency_enabled())
+    sigaction(SIGUSR1, &act, NULL);
+}
+
+/* Readable once a signal wants handling, -1 without handlers */
+int
+mb_kbd_signals_fd (void)
+{
+  return SignalFds[0];
+}
+
+void
+mb_kbd_signals_process (void)
+{
+  char buf[64];
+
+  if (SignalFds[0] >= 0)
+    while (read(SignalFds[0], buf, sizeof(buf)) > 0)
+      ;
+
+  if (DumpRequested)
+    {
+      DumpRequested = 0;
+      mb_kbd_latency_dump (stderr);
+    }
+
+  if (QuitRequested)
+    exit(0);
+}
+
 void
 mb_kbd_run(MBKeyboard *kb)
 {
+  mb_kbd_startup_done();
+
   mb_kbd_ui_event_loop(kb->ui);
 }
 
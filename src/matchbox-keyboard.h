@@ -51,6 +51,7 @@
 #endif
 
 #include "matchbox-keyboard-remote.h"
+#include "config-names.h"
 
 #if (WANT_DEBUG)
 #define DBG(x, a...) \
@@ -89,6 +90,10 @@ typedef struct MBKeyboardKey    MBKeyboardKey;
 typedef struct MBKeyboardUI     MBKeyboardUI;
 typedef struct MBKeyboardUIBackend MBKeyboardUIBackend;
 typedef struct MBKeyboardImage  MBKeyboardImage;
+typedef struct MBKeyboardInjector MBKeyboardInjector;
+typedef struct MBKeyboardConfigOps MBKeyboardConfigOps;
+typedef struct MBKeyboardConfigSource MBKeyboardConfigSource;
+typedef struct MBKeyboardConfigWatch MBKeyboardConfigWatch;
 
 typedef enum 
 {
@@ -96,6 +101,7 @@ typedef enum
   MBKeyboardKeyActionGlyph,
   MBKeyboardKeyActionXKeySym, 	/* 'specials' be converted into this */
   MBKeyboardKeyActionModifier,
+  MBKeyboardKeyActionString,    /* whole UTF8 string, typed in one go */
 
 } MBKeyboardKeyActionType;
 
@@ -147,6 +153,59 @@ typedef enum
 } 
 MBKeyboardStateType;
 
+typedef enum 
+{
+  MBKeyboardLatencyEvent = 0,
+  MBKeyboardLatencyKeyPress,
+  MBKeyboardLatencyKeyRelease,
+  MBKeyboardLatencyRedraw,
+  MBKeyboardLatencyInputToInject,
+  MBKeyboardLatencyInputToPresent,
+  MBKeyboardLatencyShow,
+  N_MBKeyboardLatencyPhases
+}
+MBKeyboardLatencyPhase;
+
+typedef enum 
+{
+  MBKeyboardStartupXConnect = 0,
+  MBKeyboardStartupInjector,
+  MBKeyboardStartupUIInit,
+  MBKeyboardStartupConfigLoad,
+  MBKeyboardStartupImageDecode,
+  MBKeyboardStartupLayoutBuild,
+  MBKeyboardStartupFontLoad,
+  MBKeyboardStartupLayoutAlloc,
+  MBKeyboardStartupWMCheck,
+  MBKeyboardStartupWindowCreate,
+  MBKeyboardStartupFirstPaint,
+  N_MBKeyboardStartupPhases
+}
+MBKeyboardStartupPhase;
+
+typedef enum 
+{
+  MBKeyboardAtomNetSupportingWMCheck = 0,
+  MBKeyboardAtomNetWMName,
+  MBKeyboardAtomUTF8String,
+  MBKeyboardAtomNetWorkarea,
+  MBKeyboardAtomNetWMState,
+  MBKeyboardAtomNetWMStateSkipPager,
+  MBKeyboardAtomNetWMStateSkipTaskbar,
+  MBKeyboardAtomOBWMStateUndecorated,
+  MBKeyboardAtomNetWMWindowType,
+  MBKeyboardAtomNetWMWindowTypeToolbar,
+  MBKeyboardAtomNetWMWindowTypeDock,
+  MBKeyboardAtomNetWMStrutPartial,
+  MBKeyboardAtomMotifWMHints,
+  MBKeyboardAtomXEmbed,
+  MBKeyboardAtomXEmbedInfo,
+  MBKeyboardAtomMBIMInvokerCommand,
+  MBKeyboardAtomMBIMCommit,
+  N_MBKeyboardAtoms
+}
+MBKeyboardAtomType;
+
 typedef enum 
 {
   MBKeyboardDisplayAny      = 0,
@@ -162,6 +221,8 @@ struct MBKeyboard
   int                    font_pt_size;
   char                  *font_variant;
   char                  *config_file;
+  MBKeyboardConfigSource *config_source; /* the layouts are built from */
+  MBKeyboardConfigWatch  *config_watch;
   List                  *layouts;
   MBKeyboardLayout      *selected_layout;
   int                    key_border, key_pad, key_margin;
@@ -215,6 +276,13 @@ mb_kbd_ui_redraw_key(MBKeyboardUI  *ui, MBKeyboardKey *key);
 void
 mb_kbd_ui_redraw(MBKeyboardUI  *ui);
 
+void mb_kbd_ui_handle_reconfigure(MBKeyboardUI *ui);
+
+void
+mb_kbd_ui_handle_layout_change(MBKeyboardUI *ui, 
+			       boolean       relayout, 
+			       List         *keys);
+
 void
 mb_kbd_ui_swap_buffers(MBKeyboardUI  *ui);
 
@@ -231,12 +299,24 @@ mb_kbd_ui_send_keysym_press(MBKeyboardUI  *ui,
 void
 mb_kbd_ui_send_release(MBKeyboardUI  *ui);
 
+void
+mb_kbd_ui_send_string(MBKeyboardUI  *ui,
+		      const char    *utf8_str,
+		      int            modifiers);
+
 int
 mb_kbd_ui_display_width(MBKeyboardUI *ui);
 
 int
 mb_kbd_ui_display_height(MBKeyboardUI *ui);
 
+boolean
+mb_kbd_ui_display_crtc_geometry(MBKeyboardUI *ui, 
+				int          *x, 
+				int          *y, 
+				int          *width, 
+				int          *height);
+
 MBKeyboardUIBackend*
 mb_kbd_ui_backend(MBKeyboardUI *ui);
 
@@ -258,6 +338,9 @@ mb_kbd_ui_x_win_width(MBKeyboardUI *ui);
 Window
 mb_kbd_ui_x_win_root(MBKeyboardUI *ui);
 
+Atom
+mb_kbd_ui_x_atom(MBKeyboardUI *ui, MBKeyboardAtomType atom);
+
 Pixmap
 mb_kbd_ui_backbuffer(MBKeyboardUI *ui);
 
@@ -272,6 +355,9 @@ mb_kbd_ui_set_embeded (MBKeyboardUI *ui, int embed);
 
 void
 mb_kbd_ui_set_daemon (MBKeyboardUI *ui, int value);
+
+void
+mb_kbd_ui_set_im_window (MBKeyboardUI *ui, Window win);
  
 int
 mb_kbd_ui_embeded (MBKeyboardUI *ui);
@@ -281,6 +367,7 @@ mb_kbd_ui_print_window (MBKeyboardUI *ui);
 
 /*** Images ***/
 
+/* Shared by path, each new() wants a destroy() */
 MBKeyboardImage*
 mb_kbd_image_new (MBKeyboard *kbd, const char *filename);
 
@@ -293,6 +380,12 @@ mb_kbd_image_height (MBKeyboardImage *img);
 void
 mb_kbd_image_destroy (MBKeyboardImage *img);
 
+void
+mb_kbd_image_invalidate (const char *filename);
+
+List*
+mb_kbd_image_preload (MBKeyboard *kbd, List *paths);
+
 /*** XEmbed ***/
 
 void
@@ -303,12 +396,90 @@ mb_kbd_xembed_process_xevents (MBKeyboardUI *ui, XEvent *xevent);
 
 /*** Remote ***/
 
-void
-mb_kbd_remote_init (MBKeyboardUI *ui);
-
 MBKeyboardRemoteOperation
 mb_kbd_remote_process_xevents (MBKeyboardUI *ui, XEvent *xevent);
 
+/*** Injection ***/
+
+MBKeyboardInjector*
+mb_kbd_inject_new (MBKeyboardUI *ui);
+
+void
+mb_kbd_inject_press (MBKeyboardInjector *inj, 
+		     const char         *utf8_char_in, 
+		     int                 modifiers);
+
+void
+mb_kbd_inject_press_keysym (MBKeyboardInjector *inj, 
+			    KeySym              ks, 
+			    int                 modifiers);
+
+void
+mb_kbd_inject_release (MBKeyboardInjector *inj);
+
+void
+mb_kbd_inject_release_modifiers (MBKeyboardInjector *inj);
+
+void
+mb_kbd_inject_string (MBKeyboardInjector *inj, 
+		      const char         *utf8_str, 
+		      int                 modifiers);
+
+void
+mb_kbd_inject_commit (MBKeyboardInjector *inj, 
+		      Window              win,
+		      const char         *utf8_str, 
+		      int                 len);
+
+KeySym
+mb_kbd_inject_ucs4_to_keysym (unsigned int ucs4);
+
+unsigned int
+mb_kbd_inject_keysym_to_ucs4 (KeySym keysym);
+
+/*** Latency ***/
+
+void
+mb_kbd_latency_init (void);
+
+boolean
+mb_kbd_latency_enabled (void);
+
+long long
+mb_kbd_latency_begin (void);
+
+void
+mb_kbd_latency_end (MBKeyboardLatencyPhase phase, long long start);
+
+void
+mb_kbd_latency_record (MBKeyboardLatencyPhase phase, long long usec);
+
+void
+mb_kbd_latency_set_event_time (Time server_time);
+
+void
+mb_kbd_latency_record_since_event (MBKeyboardLatencyPhase phase);
+
+void
+mb_kbd_latency_dump (FILE *fp);
+
+/*** Startup profile ***/
+
+void
+mb_kbd_startup_begin (void);
+
+void
+mb_kbd_startup_set_output (const char *path);
+
+boolean
+mb_kbd_startup_enabled (void);
+
+void
+mb_kbd_startup_mark (MBKeyboardStartupPhase phase);
+
+void
+mb_kbd_startup_done (void);
+
 /**** Keyboard ****/
 
 int
@@ -350,6 +521,15 @@ mb_kbd_set_extended(MBKeyboard *kb, boolean extend);
 boolean
 mb_kbd_is_extended(MBKeyboard *kb);
 
+void
+mb_kbd_signals_init (void);
+
+int
+mb_kbd_signals_fd (void);
+
+void
+mb_kbd_signals_process (void);
+
 void
 mb_kbd_add_layout(MBKeyboard *kb, MBKeyboardLayout *layout);
 
@@ -386,6 +566,12 @@ mb_kbd_redraw_key(MBKeyboard *kb, MBKeyboardKey *key);
 MBKeyboardLayout*
 mb_kbd_layout_new(MBKeyboard *kbd, const char *id);
 
+void
+mb_kbd_layout_destroy(MBKeyboardLayout *layout);
+
+const char*
+mb_kbd_layout_id(MBKeyboardLayout *layout);
+
 void
 mb_kbd_layout_append_row(MBKeyboardLayout *layout,
 			 MBKeyboardRow    *row);
@@ -393,12 +579,32 @@ mb_kbd_layout_append_row(MBKeyboardLayout *layout,
 List*
 mb_kbd_layout_rows(MBKeyboardLayout *layout);
 
+void
+mb_kbd_layout_set_ops(MBKeyboardLayout          *layout,
+		      const MBKeyboardConfigOps *ops,
+		      int                        start,
+		      int                        end);
+
+const MBKeyboardConfigOps*
+mb_kbd_layout_get_ops(MBKeyboardLayout *layout,
+		      int              *start,
+		      int              *end);
+
+void
+mb_kbd_layout_set_built(MBKeyboardLayout *layout, boolean built);
+
+boolean
+mb_kbd_layout_is_built(MBKeyboardLayout *layout);
+
 
 /**** Rows ******/
 
 MBKeyboardRow*
 mb_kbd_row_new(MBKeyboard *kbd);
 
+void
+mb_kbd_row_destroy(MBKeyboardRow *row);
+
 void
 mb_kbd_row_set_x(MBKeyboardRow *row, int x);
 
@@ -423,6 +629,11 @@ mb_kbd_row_base_width(MBKeyboardRow *row);
 void
 mb_kbd_row_append_key(MBKeyboardRow *row, MBKeyboardKey *key);
 
+void
+mb_kbd_row_replace_key(MBKeyboardRow *row,
+		       MBKeyboardKey *old,
+		       MBKeyboardKey *key);
+
 List*
 mb_kdb_row_keys(MBKeyboardRow *row);
 
@@ -437,6 +648,9 @@ mb_kdb_row_keys(MBKeyboardRow *row);
 MBKeyboardKey*
 mb_kbd_key_new(MBKeyboard *kbd);
 
+void
+mb_kbd_key_destroy(MBKeyboardKey *key);
+
 void
 mb_kbd_key_set_obey_caps(MBKeyboardKey  *key, boolean obey);
 
@@ -538,6 +752,15 @@ mb_kbd_key_set_char_action(MBKeyboardKey           *key,
 			   MBKeyboardKeyStateType   state,
 			   const char              *glyphs);
 
+void
+mb_kbd_key_set_string_action(MBKeyboardKey           *key,
+			     MBKeyboardKeyStateType   state,
+			     const char              *string);
+
+const char*
+mb_kbd_key_get_string_action(MBKeyboardKey           *key,
+			     MBKeyboardKeyStateType   state);
+
 void
 mb_kbd_key_set_keysym_action(MBKeyboardKey           *key,
 			     MBKeyboardKeyStateType   state,
@@ -580,6 +803,125 @@ mb_kbd_key_dump_key(MBKeyboardKey *key);
 int
 mb_kbd_config_load(MBKeyboard *kbd, char *varient);
 
+void
+mb_kbd_config_realize_layout(MBKeyboard *kbd, MBKeyboardLayout *layout);
+
+void
+mb_kbd_config_reload(MBKeyboard *kbd, boolean config, List *images);
+
+MBKeyboardConfigWatch*
+mb_kbd_config_watch_new (const char *config_file);
+
+void
+mb_kbd_config_watch_add (MBKeyboardConfigWatch *watch, const char *path);
+
+int
+mb_kbd_config_watch_fd (MBKeyboardConfigWatch *watch);
+
+void
+mb_kbd_config_watch_dispatch (MBKeyboard *kbd);
+
+void
+mb_kbd_config_watch_idle (MBKeyboard *kbd);
+
+/* A parsed layout as a flat list of what to build, see config-loader.c */
+
+typedef struct MBKeyboardConfigCache MBKeyboardConfigCache;
+
+typedef enum 
+{
+  MBKeyboardConfigOpLayout = 0, 	/* str is the id */
+  MBKeyboardConfigOpRow,
+  MBKeyboardConfigOpKey,		/* flags, value is the width */
+  MBKeyboardConfigOpGlyphFace,	/* the rest are for state */
+  MBKeyboardConfigOpImageFace,	/* str is the path as given, value is
+				   0 or the string it resolved to */
+  MBKeyboardConfigOpCharAction,
+  MBKeyboardConfigOpKeysymAction,	/* value is the keysym */
+  MBKeyboardConfigOpModifierAction,	/* value is the MBKeyboardKeyModType */
+  MBKeyboardConfigOpStringAction,
+  N_MBKeyboardConfigOps
+}
+MBKeyboardConfigOpType;
+
+typedef enum 
+{
+  MBKeyboardConfigKeyObeyCaps = (1<<0),
+  MBKeyboardConfigKeyExtended = (1<<1),
+  MBKeyboardConfigKeyFill     = (1<<2),
+  MBKeyboardConfigKeyBlank    = (1<<3),
+}
+MBKeyboardConfigKeyFlags;
+
+typedef struct MBKeyboardConfigOp
+{
+  unsigned char  type;		/* MBKeyboardConfigOpType */
+  unsigned char  state;		/* MBKeyboardKeyStateType */
+  unsigned short flags;
+  unsigned int   value;
+  unsigned int   str;		/* offset into the string table */
+}
+MBKeyboardConfigOp;
+
+struct MBKeyboardConfigOps
+{
+  const MBKeyboardConfigOp *ops;
+  int                       n_ops;
+  const char               *strings;
+  unsigned int              strings_size;
+};
+
+/* Shipped layouts compiled in at build time, see layout-compiler.c */
+typedef struct MBKeyboardConfigBuiltin
+{
+  const char          *name;	/* file name, eg keyboard.xml */
+  MBKeyboardConfigOps  ops;
+}
+MBKeyboardConfigBuiltin;
+
+extern const MBKeyboardConfigBuiltin MBKeyboardConfigBuiltins[];
+
+MBKeyboardConfigCache*
+mb_kbd_config_parse(const char *path, const char *data);
+
+MBKeyboardConfigCache*
+mb_kbd_config_cache_new (void);
+
+void
+mb_kbd_config_cache_append (MBKeyboardConfigCache  *cache,
+			    MBKeyboardConfigOpType  type,
+			    MBKeyboardKeyStateType  state,
+			    int                     flags,
+			    unsigned int            value,
+			    const char             *str);
+
+void
+mb_kbd_config_cache_set_value_str (MBKeyboardConfigCache *cache,
+				   int                    i,
+				   const char            *str);
+
+void
+mb_kbd_config_cache_save (MBKeyboardConfigCache *cache,
+			  const char            *config_path,
+			  struct stat           *config_stat,
+			  const char            *search);
+
+void
+mb_kbd_config_cache_free (MBKeyboardConfigCache *cache);
+
+void
+mb_kbd_config_cache_get_ops (MBKeyboardConfigCache *cache,
+			     MBKeyboardConfigOps   *ops);
+
+void*
+mb_kbd_config_cache_map (const char          *config_path,
+			 struct stat         *config_stat,
+			 const char          *search,
+			 MBKeyboardConfigOps *ops);
+
+void
+mb_kbd_config_cache_unmap (void *map);
+
 
 /**** Util *****/
 
@@ -588,6 +930,9 @@ mb_kbd_config_load(MBKeyboard *kbd, char *varient);
 #define unless(x)       if (!(x))
 #define util_abs(x)     ((x) > 0) ? (x) : -1*(x)
 
+void
+util_delegate_x_errors(Display *xdpy, XErrorHandler handler);
+
 void
 util_trap_x_errors(void);
 
@@ -603,9 +948,15 @@ util_fatal_error(char *msg);
 int
 util_utf8_char_cnt(const char *str);
 
+int
+util_utf8_get_char(const char *str, unsigned int *ucs4);
+
 boolean 
 util_file_readable(char *path);
 
+long long
+util_monotonic_usec(void);
+
 /* Util list */
 
 #define util_list_next(l) (l)->next
@@ -635,6 +986,12 @@ util_list_append(List *list, void *data);
 void
 util_list_foreach(List *list, ListForEachCB func, void *userdata);
 
+void
+util_list_free(List *list);
+
+List*
+util_list_remove(List *list, void *data);
+
 /* Backends */
 
 #if WANT_CAIRO
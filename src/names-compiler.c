@@ -0,0 +1,482 @@
+/*
+ *  Matchbox Keyboard - A lightweight software keyboard.
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2, or (at your option)
+ *  any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ */
+
+/*
+ * Build time generator for the parser's name lookups. Every tag, key
+ * state, modifier and action name it knows, plus every keysym in the X
+ * headers given, goes into a minimal perfect hash table so any of them
+ * is found with one hash and one compare rather than a walk down a list
+ * or, for xkeysym: actions, Xlib's own lookup.
+ *
+ *   matchbox-keyboard-names-compiler [keysymdef.h [XF86keysym.h]] > config-names.c
+ *
+ * The headers' U+ notes also give the keysym -> character table the
+ * injector resolves legacy keysyms, eg Cyrillic_a, with.
+ *
+ * Tables are built hash and displace style. Names are split into
+ * buckets by hash, then the biggest buckets first, each gets the first
+ * displacement that moves all of its names into free slots.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "config-names.h"
+
+typedef struct CompilerName
+{
+  const char *name;
+  const char *value;	/* as C */
+}
+CompilerName;
+
+/* See config_xml_start_cb() */
+static const CompilerName Tags[] =
+{
+  { "layout",  "MBKeyboardConfigTagLayout" },
+  { "row",     "MBKeyboardConfigTagRow" },
+  { "key",     "MBKeyboardConfigTagKey" },
+  { "space",   "MBKeyboardConfigTagSpace" },
+  { "normal",  "MBKeyboardConfigTagState" },
+  { "default", "MBKeyboardConfigTagState" },
+  { "shifted", "MBKeyboardConfigTagState" },
+  { "mod1",    "MBKeyboardConfigTagState" },
+  { "mod2",    "MBKeyboardConfigTagState" },
+  { "mod3",    "MBKeyboardConfigTagState" },
+};
+
+static const CompilerName States[] =
+{
+  { "normal",  "MBKeyboardKeyStateNormal" },
+  { "default", "MBKeyboardKeyStateNormal" },
+  { "shifted", "MBKeyboardKeyStateShifted" },
+  { "mod1",    "MBKeyboardKeyStateMod1" },
+  { "mod2",    "MBKeyboardKeyStateMod2" },
+  { "mod3",    "MBKeyboardKeyStateMod3" },
+};
+
+/* modifier:<name> actions */
+static const CompilerName Modifiers[] =
+{
+  { "shift",   "MBKeyboardKeyModShift" },
+  { "alt",     "MBKeyboardKeyModAlt" },
+  { "ctrl",    "MBKeyboardKeyModControl" },
+  { "control", "MBKeyboardKeyModControl" },
+  { "mod1",    "MBKeyboardKeyModMod1" },
+  { "mod2",    "MBKeyboardKeyModMod2" },
+  { "mod3",    "MBKeyboardKeyModMod3" },
+  { "caps",    "MBKeyboardKeyModCaps" },
+
+  // Xlab: Layout switch support
+  { "layout",  "MBKeyboardKeyModLayout" },
+
+  // Xlab: Hide keyboard key support
+  { "min",     "MBKeyboardKeyModMin" },
+};
+
+/* Plain actions naming a key rather than giving a char */
+static const CompilerName Actions[] =
+{
+  { "backspace",  "XK_BackSpace" },
+  { "tab",        "XK_Tab" },
+  { "linefeed",   "XK_Linefeed" },
+  { "clear",      "XK_Clear" },
+  { "return",     "XK_Return" },
+  { "pause",      "XK_Pause" },
+  { "scrolllock", "XK_Scroll_Lock" },
+  { "sysreq",     "XK_Sys_Req" },
+  { "escape",     "XK_Escape" },
+  { "delete",     "XK_Delete" },
+  { "home",       "XK_Home" },
+  { "insert",     "XK_Insert" },
+  { "left",       "XK_Left" },
+  { "up",         "XK_Up" },
+  { "right",      "XK_Right" },
+  { "down",       "XK_Down" },
+  { "prior",      "XK_Prior" },
+  { "pageup",     "XK_Page_Up" },
+  { "next",       "XK_Next" },
+  { "pagedown",   "XK_Page_Down" },
+  { "end",        "XK_End" },
+  { "begin",      "XK_Begin" },
+  { "space",      "XK_space" },
+  { "f1",         "XK_F1" },
+  { "f2",         "XK_F2" },
+  { "f3",         "XK_F3" },
+  { "f4",         "XK_F4" },
+  { "f5",         "XK_F5" },
+  { "f6",         "XK_F6" },
+  { "f7",         "XK_F7" },
+  { "f8",         "XK_F8" },
+  { "f9",         "XK_F9" },
+  { "f10",        "XK_F10" },
+  { "f11",        "XK_F11" },
+
+  // Xlab: Additional F-keys
+  { "f12",        "XK_F12" },
+  { "f13",        "XK_F13" },
+  { "f14",        "XK_F14" },
+  { "f15",        "XK_F15" },
+  { "f16",        "XK_F16" },
+  { "f17",        "XK_F17" },
+  { "f18",        "XK_F18" },
+  { "f19",        "XK_F19" },
+  { "f20",        "XK_F20" },
+};
+
+#define N_NAMES(t) (sizeof(t) / sizeof(CompilerName))
+
+/* Never NULL, even for nothing */
+static void*
+compiler_malloc0 (size_t size)
+{
+  void *p;
+
+  if ((p = calloc(1, size ? size : 1)) == NULL)
+    {
+      fprintf(stderr, "names-compiler: out of memory\n");
+      exit(1);
+    }
+
+  return p;
+}
+
+/* strdup() isnt ISO C, which is all a build machine is sure to have */
+static char*
+compiler_strdup (const char *str)
+{
+  return strcpy(compiler_malloc0(strlen(str) + 1), str);
+}
+
+static MBKeyboardKeysymUcs4 *CompilerUcs4   = NULL;
+static int                   CompilerNUcs4 = 0;
+
+/*
+ * Reads the '#define <prefix>XK_foo 0x...' lines of an X keysym header,
+ * named as XStringToKeysym() knows them, ie XK_foo as foo and XF86XK_foo
+ * as XF86foo. Values that arent plain hex are left to Xlib.
+*/
+static CompilerName*
+compiler_read_keysyms (const char   *path,
+		       CompilerName *keysyms,
+		       int          *n_keysyms)
+{
+  char          line[512], name[256], value[64], *prefix, *note;
+  unsigned int  ucs4;
+  FILE         *fp;
+
+  if ((fp = fopen(path, "r")) == NULL)
+    {
+      fprintf(stderr, "names-compiler: unable to open %s\n", path);
+      exit(1);
+    }
+
+  while (fgets(line, sizeof(line), fp))
+    {
+      if (sscanf(line, "#define %255s %63s", name, value) != 2
+	  || strncmp(value, "0x", 2)
+	  || value[2 + strspn(&value[2], "0123456789abcdefABCDEF")] != '\0'
+	  || (prefix = strstr(name, "XK_")) == NULL)
+	continue;
+
+      /* 
+       * Characters of keysyms outside Latin-1 and the 'Unicode' range.
+       * Notes in brackets are near misses, those are left out.
+      */
+      if ((note = strstr(line, "/* U+")) != NULL
+	  && sscanf(note, "/* U+%x", &ucs4) == 1
+	  && strtoul(value, NULL, 16) > 0xff
+	  && (strtoul(value, NULL, 16) & 0xff000000) != 0x01000000)
+	{
+	  CompilerUcs4 = realloc(CompilerUcs4, sizeof(MBKeyboardKeysymUcs4)
+				               * (CompilerNUcs4 + 1));
+	  CompilerUcs4[CompilerNUcs4].keysym = strtoul(value, NULL, 16);
+	  CompilerUcs4[CompilerNUcs4].ucs4   = ucs4;
+	  CompilerNUcs4++;
+	}
+
+      /* Whatever comes before XK_, eg XF86, is kept */
+      memmove(prefix, prefix + 3, strlen(prefix + 3) + 1);
+
+      keysyms = realloc(keysyms, sizeof(CompilerName) * (*n_keysyms + 1));
+      keysyms[*n_keysyms].name  = compiler_strdup(name);
+      keysyms[*n_keysyms].value = compiler_strdup(value);
+      (*n_keysyms)++;
+    }
+
+  fclose(fp);
+
+  return keysyms;
+}
+
+/* Drops repeats, the first seen wins like it would with a list */
+static int
+compiler_unique (CompilerName *names, int n)
+{
+  int i, j, n_unique = 0;
+
+  for (i = 0; i < n; i++)
+    {
+      for (j = 0; j < n_unique; j++)
+	if (strcmp(names[j].name, names[i].name) == 0)
+	  break;
+
+      if (j == n_unique)
+	names[n_unique++] = names[i];
+    }
+
+  return n_unique;
+}
+
+static int *CompilerBucketSizes;
+
+static int
+compiler_bucket_cmp (const void *a, const void *b)
+{
+  return CompilerBucketSizes[*(const int *)b] - CompilerBucketSizes[*(const int *)a];
+}
+
+/*
+ * Finds a displacement for every bucket, filling slots with the index of
+ * the name that goes there. 0 if some bucket wont fit, try more.
+*/
+static int
+compiler_build (const CompilerName *names,
+		int                 n,
+		int                 n_buckets,
+		unsigned short     *displace,
+		int                *slots)
+{
+  unsigned int *hashes;
+  int          *buckets, *sizes, *first, *members, *order, *try;
+  int           i, j, b;
+  int           ok = 1;
+
+  hashes  = compiler_malloc0(sizeof(unsigned int) * n);
+  buckets = compiler_malloc0(sizeof(int) * n);
+  members = compiler_malloc0(sizeof(int) * n);
+  try     = compiler_malloc0(sizeof(int) * n);
+  sizes   = compiler_malloc0(sizeof(int) * n_buckets);
+  first   = compiler_malloc0(sizeof(int) * (n_buckets + 1));
+  order   = compiler_malloc0(sizeof(int) * n_buckets);
+
+  for (i = 0; i < n; i++)
+    {
+      hashes[i]  = util_hash_str(names[i].name);
+      buckets[i] = util_hash_mix(hashes[i]) % n_buckets;
+      sizes[buckets[i]]++;
+      slots[i] = -1;
+    }
+
+  /* Each bucket's names, members[first[b]] up to members[first[b+1]] */
+  for (b = 0; b < n_buckets; b++)
+    {
+      first[b + 1] = first[b] + sizes[b];
+      order[b]     = b;
+      displace[b]  = 0;
+    }
+
+  for (i = n - 1; i >= 0; i--)
+    members[first[buckets[i]] + --sizes[buckets[i]]] = i;
+
+  for (b = 0; b < n_buckets; b++)
+    sizes[b] = first[b + 1] - first[b];
+
+  CompilerBucketSizes = sizes;
+  qsort(order, n_buckets, sizeof(int), compiler_bucket_cmp);
+
+  for (b = 0; b < n_buckets && sizes[order[b]] > 0; b++)
+    {
+      int          *member = &members[first[order[b]]];
+      unsigned int  d;
+
+      for (d = 0; d <= 0xffff; d++)
+	{
+	  for (i = 0; i < sizes[order[b]]; i++)
+	    {
+	      try[i] = MB_KBD_CONFIG_NAME_SLOT(hashes[member[i]], d, n);
+
+	      for (j = 0; j < i; j++)
+		if (try[j] == try[i])
+		  break;
+
+	      if (slots[try[i]] >= 0 || j < i)
+		break;
+	    }
+
+	  if (i == sizes[order[b]])
+	    break;
+	}
+
+      if (d > 0xffff)
+	{
+	  ok = 0;
+	  break;
+	}
+
+      displace[order[b]] = d;
+
+      for (i = 0; i < sizes[order[b]]; i++)
+	slots[try[i]] = member[i];
+    }
+
+  free(hashes);
+  free(buckets);
+  free(members);
+  free(try);
+  free(sizes);
+  free(first);
+  free(order);
+
+  return ok;
+}
+
+static void
+compiler_write_names (FILE         *fp,
+		      const char   *table,
+		      CompilerName *names,
+		      int           n)
+{
+  unsigned short *displace;
+  int            *slots;
+  int             i, n_buckets;
+
+  n = compiler_unique (names, n);
+
+  slots    = compiler_malloc0(sizeof(int) * n);
+  displace = compiler_malloc0(sizeof(unsigned short) * (n + 1));
+
+  /* Around 4 names a bucket builds quickly, more buckets if it wont */
+  for (n_buckets = n / 4 + 1; ; n_buckets++)
+    {
+      displace = realloc(displace, sizeof(unsigned short) * n_buckets);
+
+      if (compiler_build (names, n, n_buckets, displace, slots))
+	break;
+    }
+
+  fprintf(fp, "static const MBKeyboardConfigName %sNames[] =\n  {\n", table);
+
+  for (i = 0; i < n; i++)
+    fprintf(fp, "    { \"%s\", %s },\n", names[slots[i]].name, names[slots[i]].value);
+
+  /* An empty initializer wont do, n of 0 keeps lookups off it */
+  if (n == 0)
+    fprintf(fp, "    { \"\", 0 },\n");
+
+  fprintf(fp, "  };\n\n");
+
+  fprintf(fp, "static const unsigned short %sDisplace[] =\n  {", table);
+
+  for (i = 0; i < n_buckets; i++)
+    fprintf(fp, "%s%u,", (i % 12) ? " " : "\n    ", displace[i]);
+
+  fprintf(fp, "\n  };\n\n");
+
+  fprintf(fp, "const MBKeyboardConfigNames MBKeyboardConfig%s =\n"
+	  "  { %sNames, %sDisplace, %i, %i };\n\n",
+	  table, table, table, n, n_buckets);
+
+  free(slots);
+  free(displace);
+}
+
+static int
+compiler_ucs4_cmp (const void *a, const void *b)
+{
+  const MBKeyboardKeysymUcs4 *ua = a, *ub = b;
+
+  if (ua->keysym != ub->keysym)
+    return (ua->keysym < ub->keysym) ? -1 : 1;
+
+  return 0;
+}
+
+/* Sorted for a binary search, aliases of a keysym written once */
+static void
+compiler_write_ucs4 (FILE *fp)
+{
+  int i, n = 0;
+
+  qsort(CompilerUcs4, CompilerNUcs4, sizeof(MBKeyboardKeysymUcs4), 
+	compiler_ucs4_cmp);
+
+  fprintf(fp, "const MBKeyboardKeysymUcs4 MBKeyboardKeysymsUcs4[] =\n  {\n");
+
+  for (i = 0; i < CompilerNUcs4; i++)
+    if (i == 0 || CompilerUcs4[i].keysym != CompilerUcs4[i - 1].keysym)
+      {
+	fprintf(fp, "    { 0x%04x, 0x%04x },\n", 
+		CompilerUcs4[i].keysym, CompilerUcs4[i].ucs4);
+	n++;
+      }
+
+  /* An empty initializer wont do */
+  if (n == 0)
+    fprintf(fp, "    { 0, 0 },\n");
+
+  fprintf(fp, "  };\n\n");
+
+  fprintf(fp, "const unsigned int MBKeyboardKeysymsUcs4Count = %i;\n", n);
+}
+
+/* The tables are consts, copied so duplicates can be dropped in place */
+static CompilerName*
+compiler_copy (const CompilerName *names, int n)
+{
+  CompilerName *copy = compiler_malloc0(sizeof(CompilerName) * n);
+
+  memcpy(copy, names, sizeof(CompilerName) * n);
+
+  return copy;
+}
+
+int
+main(int argc, char **argv)
+{
+  CompilerName *keysyms = NULL;
+  int           i, n_keysyms = 0;
+
+  /* No headers, as with --disable-keysym-table, leaves the keysyms out */
+  for (i = 1; i < argc; i++)
+    keysyms = compiler_read_keysyms (argv[i], keysyms, &n_keysyms);
+
+  if (argc > 1 && n_keysyms == 0)
+    {
+      fprintf(stderr, "names-compiler: no keysyms found\n");
+      return 1;
+    }
+
+  printf("/* Generated by matchbox-keyboard-names-compiler, do not edit */\n\n"
+	 "#include \"matchbox-keyboard.h\"\n\n");
+
+  compiler_write_names (stdout, "Tags",
+			compiler_copy (Tags, N_NAMES(Tags)), N_NAMES(Tags));
+  compiler_write_names (stdout, "States",
+			compiler_copy (States, N_NAMES(States)), N_NAMES(States));
+  compiler_write_names (stdout, "Modifiers",
+			compiler_copy (Modifiers, N_NAMES(Modifiers)),
+			N_NAMES(Modifiers));
+  compiler_write_names (stdout, "Actions",
+			compiler_copy (Actions, N_NAMES(Actions)), N_NAMES(Actions));
+  compiler_write_names (stdout, "Keysyms", keysyms, n_keysyms);
+  compiler_write_ucs4 (stdout);
+
+  if (fflush(stdout) != 0 || ferror(stdout))
+    return 1;
+
+  return 0;
+}
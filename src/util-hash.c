@@ -0,0 +1,46 @@
+/*
+ *  Matchbox Keyboard - A lightweight software keyboard.
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2, or (at your option)
+ *  any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ */
+
+/*
+ * Apart from util.c as names-compiler.c needs them too and is built for
+ * the build machine, see config-names.h
+ */
+
+#include "config-names.h"
+
+/* FNV-1a */
+unsigned int
+util_hash_str(const char *str)
+{
+  unsigned int hash = 2166136261u;
+
+  while (*str)
+    hash = (hash ^ (unsigned char)*str++) * 16777619u;
+
+  return hash;
+}
+
+/* Spreads the bits of hash about, for when only the low ones get used */
+unsigned int
+util_hash_mix(unsigned int hash)
+{
+  hash ^= hash >> 16;
+  hash *= 0x85ebca6bu;
+  hash ^= hash >> 13;
+  hash *= 0xc2b2ae35u;
+  hash ^= hash >> 16;
+
+  return hash;
+}
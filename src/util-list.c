@@ -106,3 +106,37 @@ util_list_foreach(List *list, ListForEachCB func, void *userdata)
       list = util_list_next(list);
     }
 }
+
+void
+util_list_free(List *list)
+{
+  List *next;
+
+  for (list = util_list_get_first(list); list; list = next)
+    {
+      next = util_list_next(list);
+      free(list);
+    }
+}
+
+/* Unlinks and frees the first item holding data, returning what is left */
+List*
+util_list_remove(List *list, void *data)
+{
+  List *item;
+
+  for (item = util_list_get_first(list); item; item = util_list_next(item))
+    if (item->data == data)
+      {
+	if (item->prev)
+	  item->prev->next = item->next;
+	if (item->next)
+	  item->next->prev = item->prev;
+
+	list = item->prev ? item->prev : item->next;
+	free(item);
+	break;
+      }
+
+  return util_list_get_first(list);
+}
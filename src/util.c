@@ -1,27 +1,68 @@
 #include "matchbox-keyboard.h"
 
-static int TrappedErrorCode = 0;
-static int (*old_error_handler) (Display *, XErrorEvent *);
+/*
+ * Xlib has the one error handler for the whole process, so it is set
+ * once and errors are handed out by connection: the injector's go to
+ * the injector, see util_delegate_x_errors(), and the rest to a trap
+ * if one is set or else Xlib's own handler. Trapping only sets a flag
+ * so the handler never changes under the injection thread.
+*/
+static XErrorHandler DefaultErrorHandler = NULL;
+static boolean       ErrorHandlerInstalled = False;
+static Display      *DelegateDisplay = NULL;
+static XErrorHandler DelegateErrorHandler = NULL;
+static boolean       Trapping = False;
+static int           TrappedErrorCode = 0;
 
 static int
 error_handler(Display     *xdpy,
 	      XErrorEvent *error)
 {
-  TrappedErrorCode = error->error_code;
-  return 0;
+  if (xdpy == DelegateDisplay && DelegateErrorHandler)
+    return DelegateErrorHandler(xdpy, error);
+
+  if (Trapping)
+    {
+      TrappedErrorCode = error->error_code;
+      return 0;
+    }
+
+  return DefaultErrorHandler ? DefaultErrorHandler(xdpy, error) : 0;
+}
+
+static void
+util_install_x_error_handler(void)
+{
+  if (ErrorHandlerInstalled)
+    return;
+
+  DefaultErrorHandler   = XSetErrorHandler(error_handler);
+  ErrorHandlerInstalled = True;
+}
+
+/* Errors on xdpy go to handler, call before any thread uses xdpy */
+void
+util_delegate_x_errors(Display *xdpy, XErrorHandler handler)
+{
+  util_install_x_error_handler();
+
+  DelegateDisplay      = xdpy;
+  DelegateErrorHandler = handler;
 }
 
 void
 util_trap_x_errors(void)
 {
-  TrappedErrorCode  = 0;
-  old_error_handler = XSetErrorHandler(error_handler);
+  util_install_x_error_handler();
+
+  TrappedErrorCode = 0;
+  Trapping         = True;
 }
 
 int
 util_untrap_x_errors(void)
 {
-  XSetErrorHandler(old_error_handler);
+  Trapping = False;
   return TrappedErrorCode;
 }
 
@@ -98,6 +139,33 @@ util_utf8_char_cnt(const char *str)
   return result;
 }
 
+int
+util_utf8_get_char(const char *str, unsigned int *ucs4)
+{
+  const unsigned char *p = (unsigned char *)str;
+  unsigned int         result;
+  int                  mask, len, i;
+
+  UTF8_COMPUTE(*p, mask, len);
+
+  if (len == -1)
+    return -1;
+
+  result = p[0] & mask;
+
+  for (i = 1; i < len; i++)
+    {
+      if ((p[i] & 0xc0) != 0x80)
+	return -1;
+
+      result = (result << 6) | (p[i] & 0x3f);
+    }
+
+  *ucs4 = result;
+
+  return len;
+}
+
 boolean 
 util_file_readable(char *path)
 {
@@ -109,3 +177,13 @@ util_file_readable(char *path)
  return True;
 }
 
+
+long long
+util_monotonic_usec(void)
+{
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+
+  return (long long)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}